@@ -0,0 +1,328 @@
+// alsa.c - ALSA PCM backend
+//
+// PCMs are opened non-blocking and waited for on their poll descriptors. With mmap
+// access the transfers go straight to and from the DMA buffer, otherwise they are
+// read and written through the chunk buffer.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include "arena.h"
+#include "backend.h"
+#include "util.h"
+
+typedef struct
+{
+    snd_pcm_t *handle;
+    int mmap;
+    snd_pcm_uframes_t offset;   // of the area given by the last mmap begin
+} alsa_t;
+
+
+static int xrun_recovery(snd_pcm_t *handle, int err)
+{
+
+    if (err == -EPIPE)
+    { /* under-run */
+        err = snd_pcm_prepare(handle);
+        if (err < 0)
+            fprintf(stderr, "Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+    }
+    else if (err == -ESTRPIPE)
+    {
+        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
+            sleep(0.01); /* wait until the suspend flag is released */
+        if (err < 0)
+        {
+            err = snd_pcm_prepare(handle);
+            if (err < 0)
+                fprintf(stderr, "Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
+        }
+    }
+    return err;
+}
+
+static int set_params(snd_pcm_t *handle, unsigned rate, unsigned channels, unsigned chunk_size)
+{
+    snd_pcm_hw_params_t *hw_params;
+    int err;
+    int mmap = 0;
+
+    // on the stack, as the PCM may be reopened after startup
+    snd_pcm_hw_params_alloca(&hw_params);
+
+    err = snd_pcm_hw_params_any(handle, hw_params);
+    assert(err >= 0);
+
+    // mmap
+    if (snd_pcm_hw_params_test_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0)
+    {
+        mmap = 1;
+        err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    }
+    else
+    {
+        err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    }
+    assert(err >= 0);
+
+    err = snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_FORMAT_S16_LE);
+    assert(err >= 0);
+
+    err = snd_pcm_hw_params_set_rate(handle, hw_params, rate, 0);
+    assert(err >= 0);
+
+    err = snd_pcm_hw_params_set_channels(handle, hw_params, channels);
+    assert(err >= 0);
+
+    err = snd_pcm_hw_params_set_buffer_size(handle, hw_params, chunk_size * 2);
+    assert(err >= 0);
+
+    // No supported by PulseAudio's ALSA plugin
+    // err = snd_pcm_hw_params_set_period_size(handle, hw_params, chunk_size, 0);
+    // assert(err >= 0);
+
+    err = snd_pcm_hw_params(handle, hw_params);
+    if (err < 0)
+    {
+        fprintf(stderr, "Unable to install hw params: %s\n", snd_strerror(err));
+        return err;
+    }
+
+    // {
+    //     snd_output_t *out;
+    //     snd_output_stdio_attach(&out, stderr, 0);
+    //     snd_pcm_hw_params_dump(hw_params, out);
+    //     snd_output_close(out);
+    // }
+
+    return mmap;
+}
+
+static int alsa_init(backend_t *dev)
+{
+    dev->state = arena_alloc("audio state", sizeof(alsa_t));
+
+    return 0;
+}
+
+// open the PCM and install the parameters
+static int alsa_open(backend_t *dev)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+    int err;
+
+    err = snd_pcm_open(&pcm->handle, dev->name,
+                       dev->playback ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+    if (err < 0)
+    {
+        fprintf(stderr, "cannot open audio device %s (%s)\n",
+                dev->name,
+                snd_strerror(err));
+        pcm->handle = NULL;
+        return err;
+    }
+
+    err = set_params(pcm->handle, dev->rate, dev->channels, dev->buffer_size / 2);
+    if (err < 0)
+    {
+        snd_pcm_close(pcm->handle);
+        pcm->handle = NULL;
+        return err;
+    }
+    pcm->mmap = err;
+
+    return 0;
+}
+
+static void alsa_close(backend_t *dev)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    if (pcm->handle)
+    {
+        snd_pcm_close(pcm->handle);
+        pcm->handle = NULL;
+    }
+}
+
+static int alsa_start(backend_t *dev)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    if (snd_pcm_state(pcm->handle) == SND_PCM_STATE_PREPARED)
+    {
+        return snd_pcm_start(pcm->handle);
+    }
+
+    return 0;
+}
+
+static int alsa_poll_fds(backend_t *dev, struct pollfd *pfds, int space)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    int nfds = snd_pcm_poll_descriptors_count(pcm->handle);
+    if (nfds <= 0 || nfds > space)
+    {
+        return -1;
+    }
+
+    return snd_pcm_poll_descriptors(pcm->handle, pfds, nfds);
+}
+
+static unsigned short alsa_revents(backend_t *dev, struct pollfd *pfds, int nfds)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+    unsigned short revents = 0;
+
+    if (snd_pcm_poll_descriptors_revents(pcm->handle, pfds, nfds, &revents) < 0)
+    {
+        revents = POLLERR;
+    }
+
+    return revents;
+}
+
+// a PCM is waited for on its descriptors
+static int64_t alsa_ready_us(backend_t *dev)
+{
+    return 0;
+}
+
+static long alsa_avail(backend_t *dev)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    // poll() has synced the hardware position of a mapped PCM, reads and writes go by it
+    return pcm->mmap ? snd_pcm_avail_update(pcm->handle) : snd_pcm_avail(pcm->handle);
+}
+
+// A playback frame written now is heard after the frames queued before it, a captured
+// frame read now was recorded the queued frames earlier.
+static int alsa_delay(backend_t *dev, int64_t *time_us, long *frames)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+    snd_pcm_sframes_t delay;
+
+    int err = snd_pcm_delay(pcm->handle, &delay);
+    if (err < 0)
+    {
+        return err;
+    }
+
+    int64_t queued_us = (int64_t)delay * 1000000 / dev->rate;
+    int64_t now = (int64_t)now_us();
+
+    *time_us = dev->playback ? now + queued_us : now - queued_us;
+    *frames = delay;
+
+    return 0;
+}
+
+static long alsa_begin(backend_t *dev, char **area, unsigned long frames)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    if (pcm->mmap)
+    {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t size = frames;
+
+        int err = snd_pcm_mmap_begin(pcm->handle, &areas, &pcm->offset, &size);
+        if (err < 0)
+        {
+            return err;
+        }
+
+        // interleaved access, all channels share the first area
+        *area = (char *)areas[0].addr + (areas[0].first + pcm->offset * areas[0].step) / 8;
+        return size;
+    }
+
+    if (frames > dev->chunk_size)
+    {
+        frames = dev->chunk_size;
+    }
+    *area = dev->chunk;
+    if (dev->playback)
+    {
+        return frames;
+    }
+
+    snd_pcm_sframes_t r = snd_pcm_readi(pcm->handle, dev->chunk, frames);
+
+    return r == -EAGAIN ? 0 : r;
+}
+
+static long alsa_commit(backend_t *dev, unsigned long frames)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+    snd_pcm_sframes_t r;
+
+    if (pcm->mmap)
+    {
+        r = snd_pcm_mmap_commit(pcm->handle, pcm->offset, frames);
+        if (r >= 0 && (snd_pcm_uframes_t)r != frames)
+        {
+            r = -EPIPE;
+        }
+    }
+    else if (dev->playback)
+    {
+        r = snd_pcm_writei(pcm->handle, dev->chunk, frames);
+        if (r == -EAGAIN)
+        {
+            r = 0;
+        }
+    }
+    else
+    {
+        return frames;      // read by begin()
+    }
+
+    // committing to the mmap area doesn't start the stream, also after snd_pcm_prepare() in a recovery
+    if (r > 0 && dev->playback)
+    {
+        int err = alsa_start(dev);
+        if (err < 0)
+        {
+            return err;
+        }
+    }
+
+    return r;
+}
+
+static int alsa_recover(backend_t *dev, int err)
+{
+    alsa_t *pcm = (alsa_t *)dev->state;
+
+    // a poll error is -EPIPE, also when the PCM was suspended
+    if (err == -EPIPE && snd_pcm_state(pcm->handle) == SND_PCM_STATE_SUSPENDED)
+    {
+        err = -ESTRPIPE;
+    }
+
+    return xrun_recovery(pcm->handle, err);
+}
+
+const backend_ops_t g_alsa_ops = {
+    .init = alsa_init,
+    .open = alsa_open,
+    .close = alsa_close,
+    .start = alsa_start,
+    .poll_fds = alsa_poll_fds,
+    .revents = alsa_revents,
+    .ready_us = alsa_ready_us,
+    .avail = alsa_avail,
+    .delay = alsa_delay,
+    .begin = alsa_begin,
+    .commit = alsa_commit,
+    .recover = alsa_recover,
+};
@@ -0,0 +1,238 @@
+// arena.c - startup-time bump allocator with a per-component memory report
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "stats.h"
+
+#define ARENA_ALIGN 64                  // cache line
+#define ARENA_HUGEPAGE (2 * 1024 * 1024)
+#define ARENA_COMPONENTS 32
+#define ARENA_MIRRORS 16
+
+typedef struct
+{
+    char name[32];
+    char stat_name[40];
+    size_t arena_bytes;     // in the arena
+    size_t other_bytes;     // held elsewhere, e.g. by SpeexDSP
+} component_t;
+
+static char *g_base = NULL;
+static size_t g_reserved = 0;
+static size_t g_mapped = 0;
+static size_t g_used = 0;
+static int g_sealed = 0;
+static component_t g_components[ARENA_COMPONENTS];
+static int g_component_count = 0;
+static void *g_mirrors[ARENA_MIRRORS];     // mirrored mappings, twice their size
+static size_t g_mirror_sizes[ARENA_MIRRORS];
+static int g_mirror_count = 0;
+
+static component_t *arena_component(const char *name)
+{
+    for (int i = 0; i < g_component_count; i++)
+    {
+        if (strcmp(g_components[i].name, name) == 0)
+        {
+            return &g_components[i];
+        }
+    }
+
+    if (g_component_count >= ARENA_COMPONENTS)
+    {
+        fprintf(stderr, "Too many memory components\n");
+        exit(1);
+    }
+
+    component_t *c = &g_components[g_component_count++];
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    snprintf(c->stat_name, sizeof(c->stat_name), "mem_%s", name);
+    for (char *p = c->stat_name; *p; p++)
+    {
+        if (*p == ' ')
+        {
+            *p = '_';
+        }
+    }
+
+    return c;
+}
+
+// Reserve address space only, pages are backed when buffers are allocated
+int arena_init(size_t reserve)
+{
+    g_reserved = reserve;
+    g_mapped = reserve + ARENA_HUGEPAGE;
+
+    void *map = mmap(NULL, g_mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Fail to reserve %zu bytes of memory\n", reserve);
+        exit(1);
+    }
+
+    // align the base to a huge page, and give back the unused head
+    uintptr_t addr = (uintptr_t)map;
+    uintptr_t aligned = (addr + ARENA_HUGEPAGE - 1) & ~(uintptr_t)(ARENA_HUGEPAGE - 1);
+    if (aligned > addr)
+    {
+        munmap(map, aligned - addr);
+    }
+    g_base = (char *)aligned;
+    g_mapped -= aligned - addr;
+    g_used = 0;
+    g_sealed = 0;
+
+    return 0;
+}
+
+// Allocate zeroed memory. Pages are touched now, so no page fault happens while processing.
+void *arena_alloc(const char *name, size_t size)
+{
+    if (g_sealed)
+    {
+        fprintf(stderr, "Allocate %zu bytes for %s after startup\n", size, name);
+        exit(1);
+    }
+
+    size_t offset = (g_used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (g_base == NULL || offset + size > g_reserved)
+    {
+        fprintf(stderr, "Fail to allocate %zu bytes for %s\n", size, name);
+        exit(1);
+    }
+
+    char *ptr = g_base + offset;
+    memset(ptr, 0, size);
+    g_used = offset + size;
+    arena_component(name)->arena_bytes += size;
+
+    return ptr;
+}
+
+// Allocate zeroed memory mapped twice back to back, so the bytes right past the end are the
+// ones at the start. The size must be a multiple of the page size. Return NULL if it isn't
+// or the kernel can't map it, and the caller falls back to arena_alloc().
+void *arena_alloc_mirrored(const char *name, size_t size)
+{
+    if (g_sealed)
+    {
+        fprintf(stderr, "Allocate %zu bytes for %s after startup\n", size, name);
+        exit(1);
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (size == 0 || size % page != 0 || g_mirror_count >= ARENA_MIRRORS)
+    {
+        return NULL;
+    }
+
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // reserve both halves, then map the same pages over each, touched now like the arena
+    char *addr = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+    {
+        addr = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (addr != MAP_FAILED &&
+        (mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED ||
+         mmap(addr + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_POPULATE, fd, 0) == MAP_FAILED))
+    {
+        munmap(addr, 2 * size);
+        addr = MAP_FAILED;
+    }
+    close(fd);  // the mappings keep the pages
+
+    if (addr == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    g_mirrors[g_mirror_count] = addr;
+    g_mirror_sizes[g_mirror_count] = 2 * size;
+    g_mirror_count++;
+    arena_component(name)->arena_bytes += size;
+
+    return addr;
+}
+
+// Account memory that can't live in the arena
+void arena_account(const char *name, size_t size)
+{
+    arena_component(name)->other_bytes += size;
+}
+
+// Bytes allocated from the heap so far, to measure allocations made by libraries
+size_t arena_heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    struct mallinfo mi = mallinfo();
+    return (size_t)(unsigned)mi.uordblks + (size_t)(unsigned)mi.hblkhd;
+#endif
+}
+
+// Stop allocating, give back the unused reservation and report the footprint
+void arena_seal(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t keep = (g_used + page - 1) & ~(size_t)(page - 1);
+    size_t total = 0;
+
+    if (keep < g_mapped)
+    {
+        munmap(g_base + keep, g_mapped - keep);
+        g_mapped = keep;
+    }
+    if (keep >= ARENA_HUGEPAGE)
+    {
+        madvise(g_base, keep & ~(size_t)(ARENA_HUGEPAGE - 1), MADV_HUGEPAGE);
+    }
+    g_sealed = 1;
+
+    printf("memory footprint:\n");
+    for (int i = 0; i < g_component_count; i++)
+    {
+        component_t *c = &g_components[i];
+        size_t bytes = c->arena_bytes + c->other_bytes;
+        printf("  %-20s %10zu bytes%s\n", c->name, bytes, c->other_bytes ? " (heap)" : "");
+        stats_set(c->stat_name, bytes);
+        total += bytes;
+    }
+    printf("  %-20s %10zu bytes (arena %zu bytes)\n", "total", total, g_used);
+    stats_set("mem_total", total);
+    stats_set("mem_arena", g_used);
+}
+
+void arena_destroy(void)
+{
+    if (g_base)
+    {
+        munmap(g_base, g_mapped);
+        g_base = NULL;
+    }
+
+    for (int i = 0; i < g_mirror_count; i++)
+    {
+        munmap(g_mirrors[i], g_mirror_sizes[i]);
+    }
+    g_mirror_count = 0;
+    g_component_count = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// One memory arena for all buffers, allocated at startup and sealed before processing starts
+
+int arena_init(size_t reserve);
+void *arena_alloc(const char *name, size_t size);
+void *arena_alloc_mirrored(const char *name, size_t size);
+void arena_account(const char *name, size_t size);
+size_t arena_heap_used(void);
+void arena_seal(void);
+void arena_destroy(void);
+
+#endif // _ARENA_H_
@@ -2,144 +2,379 @@
 
 #define _GNU_SOURCE
 
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <errno.h>
 #include <error.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 
-#include <alsa/asoundlib.h>
-
 #include "pa_ringbuffer.h"
+#include "arena.h"
 #include "audio.h"
+#include "backend.h"
 #include "conf.h"
+#include "fifo.h"
+#include "prompt.h"
+#include "ring.h"
+#include "simdev.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
-PaUtilRingBuffer g_playback_ringbuffer;
-PaUtilRingBuffer g_capture_ringbuffer;
-
-static pthread_t g_playback_thread;
-static pthread_t g_capture_thread;
+#define CHUNK_SIZE 1024         // frames per ALSA transfer
+#define MAX_PCM_POLL_FDS 8
+#define ALIGN_SETTLE 100        // alignment updates before the startup offset is taken as the target
+#define ALIGN_SMOOTHING 32
+#define ALIGN_STEP_MS 10        // a larger change is a step, e.g. after an xrun, not jitter
+#define ALIGN_TOLERANCE_MS 2
 
 extern int g_is_quit;
 
 
-static int xrun_recovery(snd_pcm_t *handle, int err)
+static void ring_fill_silence(PaUtilRingBuffer *ring, ring_buffer_size_t frames)
 {
+    void *data1, *data2;
+    ring_buffer_size_t size1, size2;
 
-    if (err == -EPIPE)
-    { /* under-run */
-        err = snd_pcm_prepare(handle);
-        if (err < 0)
-            fprintf(stderr, "Can't recovery from underrun, prepare failed: %s\n", snd_strerror(err));
+    ring_buffer_size_t count = PaUtil_GetRingBufferWriteRegions(ring, frames, &data1, &size1, &data2, &size2);
+    memset(data1, 0, size1 * ring->elementSizeBytes);
+    if (size2 > 0)
+    {
+        memset(data2, 0, size2 * ring->elementSizeBytes);
     }
-    else if (err == -ESTRPIPE)
+    PaUtil_AdvanceRingBufferWriteIndex(ring, count);
+}
+
+// Close a device that can't recover and open it again with the same parameters,
+// retrying until the device is back. The ring buffer gets silence for the outage,
+// so the AEC keeps its state and the streams stay aligned.
+// Return -1 if quit came first.
+static int device_reopen(backend_t *dev, PaUtilRingBuffer *ring, const char *stat)
+{
+    double start = now_us();
+    unsigned wait_ms = 10;
+
+    fprintf(stderr, "reopen audio device %s\n", dev->name);
+    dev->ops->close(dev);
+
+    while (!g_is_quit)
     {
-        while ((err = snd_pcm_resume(handle)) == -EAGAIN)
-            sleep(0.01); /* wait until the suspend flag is released */
-        if (err < 0)
+        if (dev->ops->open(dev) == 0)
+        {
+            double outage_us = now_us() - start;
+            ring_fill_silence(ring, outage_us * dev->rate / 1000000);
+            printf("audio device %s recovered in %.1f ms\n", dev->name, outage_us / 1000);
+            stats_add(stat, 1);
+            return 0;
+        }
+
+        usleep(wait_ms * 1000);
+        if (wait_ms < 1000)
         {
-            err = snd_pcm_prepare(handle);
-            if (err < 0)
-                fprintf(stderr, "Can't recovery from suspend, prepare failed: %s\n", snd_strerror(err));
+            wait_ms *= 2;
         }
     }
-    return err;
+
+    return -1;
 }
 
-int set_params(snd_pcm_t *handle, snd_pcm_hw_params_t *hw_params, unsigned rate, unsigned channels, unsigned chunk_size)
+enum
 {
-    int err;
-    int mmap = 0;
+    JITTER_IDLE,      // no playback stream
+    JITTER_BUFFERING, // stream started or starved, wait for target fill
+    JITTER_PLAYING
+};
 
-    err = snd_pcm_hw_params_malloc(&hw_params);
-    assert(err >= 0);
+typedef struct
+{
+    PaUtilRingBuffer ring;
+    unsigned rate;
+    unsigned target;        // frames buffered before (re)starting playback
+    unsigned min_target;
+    unsigned max_target;
+    unsigned step;
+    int state;
+    int starved;            // ran dry while playing, not yet known if stream ended
+    unsigned waiting;       // frames of time spent in JITTER_BUFFERING
+    unsigned stable;        // frames played since last underrun
+    unsigned underruns;
+    const char *stat_underruns;
+} jitter_t;
+
+// When the frame at a ring buffer position passes the converter, published by the
+// device thread and read by the processing thread
+typedef struct
+{
+    unsigned seq;                       // odd while being written
+    int64_t time_us;
+    ring_buffer_size_t index;
+} hw_clock_t;
 
-    err = snd_pcm_hw_params_any(handle, hw_params);
-    assert(err >= 0);
+typedef struct _audio_t
+{
+    PaUtilRingBuffer playback_ring;     // played audio, the AEC reference
+    PaUtilRingBuffer capture_ring;
+    int playback_mirrored;              // frames are read in place, see ring.h
+    int capture_mirrored;
+    pthread_t playback_thread;
+    pthread_t capture_thread;
+    jitter_t jitter;
+    char *playback_fifo_buf;
+    backend_t *playback_dev;            // ALSA or simulated, see backend.h
+    backend_t *capture_dev;
+    hw_clock_t playback_clock;          // when the next frame written to the playback ring reaches the DAC
+    hw_clock_t capture_clock;           // when the next frame written to the capture ring left the ADC
+    double align_offset;                // smoothed capture minus reference time of the next reads, in frames
+    double align_target;
+    unsigned align_updates;
+    long align_corrections;
+    char stat_lost[48];
+    char stat_underruns[48];
+    char stat_capture_reopens[48];
+    char stat_playback_reopens[48];
+    char stat_playback_delay[48];
+    char stat_capture_delay[48];
+    char stat_align_error[48];
+    char stat_align_corrections[48];
+    char stat_bypass_transitions[48];
+} audio_t;
+
+static void hw_clock_publish(hw_clock_t *clock, int64_t time_us, ring_buffer_size_t index)
+{
+    __atomic_add_fetch(&clock->seq, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&clock->time_us, time_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&clock->index, index, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&clock->seq, 1, __ATOMIC_RELEASE);
+}
 
-    // mmap
-    if (snd_pcm_hw_params_test_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0)
+// return 0 if nothing is published yet
+static int hw_clock_read(hw_clock_t *clock, int64_t *time_us, ring_buffer_size_t *index)
+{
+    unsigned seq;
+
+    do
     {
-        mmap = 1;
-        err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
-    }
-    else
+        seq = __atomic_load_n(&clock->seq, __ATOMIC_ACQUIRE);
+        *time_us = __atomic_load_n(&clock->time_us, __ATOMIC_RELAXED);
+        *index = __atomic_load_n(&clock->index, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&clock->seq, __ATOMIC_RELAXED));
+
+    return seq != 0;
+}
+
+// Sample the queue depth of a device after a transfer
+static void hw_clock_update(hw_clock_t *clock, backend_t *dev, PaUtilRingBuffer *ring, const char *stat_delay)
+{
+    int64_t time_us;
+    long delay;
+
+    if (dev->ops->delay(dev, &time_us, &delay) < 0)
     {
-        err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+        return;
     }
-    assert(err >= 0);
 
-    err = snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_FORMAT_S16_LE);
-    assert(err >= 0);
+    hw_clock_publish(clock, time_us, ring->writeIndex);
+    stats_set(stat_delay, delay);
+}
+
+// signed distance from ring position b to a, both masked ring indexes
+static long ring_distance(PaUtilRingBuffer *ring, ring_buffer_size_t a, ring_buffer_size_t b)
+{
+    long d = (a - b) & ring->bigMask;
 
-    err = snd_pcm_hw_params_set_rate(handle, hw_params, rate, 0);
-    assert(err >= 0);
+    // a read index a full ring behind the write index is -bufferSize, not +bufferSize
+    return d >= ring->bufferSize ? d - (ring->bigMask + 1) : d;
+}
 
-    err = snd_pcm_hw_params_set_channels(handle, hw_params, channels);
-    assert(err >= 0);
+static void jitter_init(jitter_t *jb, unsigned rate, unsigned frame_bytes, unsigned chunk_size)
+{
+    jb->rate = rate;
+    jb->min_target = chunk_size;
+    jb->max_target = chunk_size * 8;
+    jb->step = chunk_size / 2;
+    jb->target = jb->min_target;
+    jb->state = JITTER_IDLE;
+    jb->starved = 0;
+    jb->waiting = 0;
+    jb->stable = 0;
+    jb->underruns = 0;
+
+    // room for max_target plus one chunk of read-ahead
+    unsigned size = power2(jb->max_target + chunk_size);
+    void *buf = arena_alloc("jitter buffer", size * frame_bytes);
+    PaUtil_InitializeRingBuffer(&jb->ring, frame_bytes, size, buf);
+}
 
-    err = snd_pcm_hw_params_set_buffer_size(handle, hw_params, chunk_size * 2);
-    assert(err >= 0);
+// Get `frames` frames of audio to play. Missing frames are filled with zero.
+// Return the number of frames taken from the stream, 0 when there is nothing to play.
+static unsigned jitter_pull(jitter_t *jb, char *buf, unsigned frames)
+{
+    unsigned available = PaUtil_GetRingBufferReadAvailable(&jb->ring);
+    unsigned count = 0;
 
-    // No supported by PulseAudio's ALSA plugin
-    // err = snd_pcm_hw_params_set_period_size(handle, hw_params, chunk_size, 0);
-    // assert(err >= 0);
+    if (jb->state == JITTER_IDLE && available > 0)
+    {
+        jb->state = JITTER_BUFFERING;
+        jb->waiting = 0;
+    }
 
-    err = snd_pcm_hw_params(handle, hw_params);
-    if (err < 0)
+    if (jb->state == JITTER_BUFFERING)
     {
-        fprintf(stderr, "Unable to install hw params:");
-        exit(1);
+        if (available > 0 && jb->starved)
+        {
+            // data arrived again, the producer was late rather than finished
+            jb->starved = 0;
+            jb->underruns++;
+            stats_set(jb->stat_underruns, jb->underruns);
+            if (jb->target + jb->step <= jb->max_target)
+            {
+                jb->target += jb->step;
+            }
+            printf("playback underrun %u, jitter buffer %u ms\n",
+                   jb->underruns, jb->target * 1000 / jb->rate);
+        }
+
+        // start when enough is buffered, or flush the tail of a short stream
+        if ((available >= jb->target) || (available > 0 && jb->waiting >= jb->target))
+        {
+            jb->state = JITTER_PLAYING;
+        }
+        else
+        {
+            jb->waiting += frames;
+            if (available == 0 && jb->waiting >= jb->rate)
+            {
+                // nothing for 1 second, the stream ended
+                jb->state = JITTER_IDLE;
+                jb->starved = 0;
+            }
+        }
     }
 
-    // {
-    //     snd_output_t *out;
-    //     snd_output_stdio_attach(&out, stderr, 0);
-    //     snd_pcm_hw_params_dump(hw_params, out);
-    //     snd_output_close(out);
-    // }
+    if (jb->state == JITTER_PLAYING)
+    {
+        count = PaUtil_ReadRingBuffer(&jb->ring, buf, frames < available ? frames : available);
+        if (count < frames)
+        {
+            jb->state = JITTER_BUFFERING;
+            jb->starved = 1;
+            jb->waiting = 0;
+            jb->stable = 0;
+        }
+        else
+        {
+            jb->stable += count;
+            // shrink after 10 seconds without underrun
+            if (jb->stable >= jb->rate * 10 && jb->target - jb->step >= jb->min_target)
+            {
+                jb->target -= jb->step;
+                jb->stable = 0;
+                printf("jitter buffer %u ms\n", jb->target * 1000 / jb->rate);
+            }
+        }
+    }
 
-    return mmap;
+    memset(buf + count * jb->ring.elementSizeBytes, 0, (frames - count) * jb->ring.elementSizeBytes);
+
+    return count;
 }
 
-void *playback(void *ptr)
+// Take `frames` frames to play from the jitter buffer and mix in the prompt that is playing.
+// Return the number of frames with audio, 0 when there is nothing to play.
+static unsigned playback_pull(conf_t *conf, jitter_t *jb, char *buf, unsigned frames)
 {
-    snd_pcm_hw_params_t *hw_params = NULL;
-    int err;
-    unsigned chunk_bytes;
-    unsigned frame_bytes;
-    char *chunk = NULL;
-    snd_pcm_t *handle;
-    unsigned chunk_size = 1024;
-    unsigned zero_count = 0;
-    conf_t *conf = (conf_t *)ptr;
-    int mmap = 0;
+    unsigned count = jitter_pull(jb, buf, frames);
 
-    if ((err = snd_pcm_open(&handle, conf->out_pcm, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
+    if (conf->prompts)
     {
-        fprintf(stderr, "cannot open audio device %s (%s)\n",
-                conf->out_pcm,
-                snd_strerror(err));
-        exit(1);
+        unsigned mixed = prompt_mix(conf->prompts, (int16_t *)buf, frames);
+        count = mixed > count ? mixed : count;
     }
 
-    mmap = set_params(handle, hw_params, conf->rate, conf->ref_channels, chunk_size);
+    return count;
+}
 
-    frame_bytes = conf->ref_channels * 2;
-    chunk_bytes = chunk_size * frame_bytes;
-    chunk = (char *)malloc(chunk_bytes);
-    if (chunk == NULL)
+static void update_bypass(conf_t *conf, unsigned count, unsigned frames, unsigned *zero_count)
+{
+    if (0 == count)
     {
-        fprintf(stderr, "not enough memory\n");
-        exit(1);
+        // bypass AEC when no playback
+        if (*zero_count > (conf->filter_length + conf->audio->playback_ring.bufferSize))
+        {
+            if (!conf->bypass)
+            {
+                conf->bypass = 1;
+                stats_add(conf->audio->stat_bypass_transitions, 1);
+                printf("No playback, bypass AEC\n");
+            }
+        }
+        else
+        {
+            *zero_count += frames;
+        }
+    }
+    else
+    {
+        if (conf->bypass)
+        {
+            conf->bypass = 0;
+            *zero_count = 0;
+            stats_add(conf->audio->stat_bypass_transitions, 1);
+            printf("Enable AEC\n");
+        }
+    }
+}
+
+// Move what the FIFO has, up to the jitter buffer target plus a chunk, into the jitter buffer
+static void playback_fifo_read(int fd, jitter_t *jb, char *fifo_buf, unsigned *fifo_bytes,
+                               unsigned frame_bytes, unsigned chunk_size)
+{
+    unsigned chunk_bytes = chunk_size * frame_bytes;
+    unsigned buffered = PaUtil_GetRingBufferReadAvailable(&jb->ring) + *fifo_bytes / frame_bytes;
+    if (buffered >= jb->target + chunk_size)
+    {
+        return;
+    }
+
+    unsigned space = (jb->target + chunk_size - buffered) * frame_bytes;
+    if (space > chunk_bytes - *fifo_bytes)
+    {
+        space = chunk_bytes - *fifo_bytes;
     }
 
+    int result = read(fd, fifo_buf + *fifo_bytes, space);
+    if (result < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            fprintf(stderr, "read() returned %d, errno = %d\n", result, errno);
+            exit(1);
+        }
+    }
+    else
+    {
+        *fifo_bytes += result;
+
+        // only whole frames go to the jitter buffer
+        unsigned frames = *fifo_bytes / frame_bytes;
+        PaUtil_WriteRingBuffer(&jb->ring, fifo_buf, frames);
+        *fifo_bytes -= frames * frame_bytes;
+        memmove(fifo_buf, fifo_buf + frames * frame_bytes, *fifo_bytes);
+    }
+}
+
+// Open the playback FIFO without blocking, creating it if needed
+static int playback_fifo_open(conf_t *conf, unsigned chunk_bytes, int *dummy_fd)
+{
     struct stat st;
 
     if (stat(conf->playback_fifo, &st) != 0)
@@ -158,6 +393,15 @@ void *playback(void *ptr)
         fprintf(stderr, "failed to open %s, error %d\n", conf->playback_fifo, fd);
         exit(1);
     }
+
+    // keep a writer open, so poll() doesn't report POLLHUP after a producer exits
+    *dummy_fd = open(conf->playback_fifo, O_WRONLY | O_NONBLOCK);
+    if (*dummy_fd < 0)
+    {
+        fprintf(stderr, "failed to open %s for writing, error %d\n", conf->playback_fifo, *dummy_fd);
+        exit(1);
+    }
+
     long pipe_size = (long)fcntl(fd, F_GETPIPE_SZ);
     if (pipe_size == -1)
     {
@@ -178,279 +422,953 @@ void *playback(void *ptr)
     }
     printf("new pipe size: %ld\n", pipe_size);
 
-    int wait_us = chunk_size * 1000000 / conf->rate / 4;
-    while (!g_is_quit)
+
+    return fd;
+}
+
+// Event loop of the devices and FIFOs. In single thread mode one loop runs all of them,
+// see audio_loop(), otherwise the playback and the capture thread each run their side.
+
+#define LOOP_TIMEOUT_MS 100     // longest wait, to notice quit and a new output FIFO reader
+#define LOOP_EVENTS 16
+#define LOOP_BATCHES 4          // processing batches between device transfers
+#define LOOP_ARRAYS 16          // pipelines one loop runs
+
+enum
+{
+    LOOP_FIFO_IN = 1,
+    LOOP_FIFO_OUT,
+    LOOP_PLAYBACK,
+    LOOP_CAPTURE
+};
+
+// what a loop runs
+enum
+{
+    RUN_PLAYBACK = 1,           // the playback FIFO and device
+    RUN_CAPTURE = 2,
+    RUN_OUTPUT = 4,             // the output FIFO
+    RUN_ALL = RUN_PLAYBACK | RUN_CAPTURE | RUN_OUTPUT
+};
+
+// epoll tag of a descriptor, the kind, the pipeline and the index of a PCM poll descriptor
+#define LOOP_TAG(kind, array, index) ((kind) << 16 | (array) << 8 | (index))
+
+typedef struct
+{
+    backend_t *dev;             // NULL when the loop doesn't run it, or it failed to reopen on quit
+    struct pollfd pfds[MAX_PCM_POLL_FDS];
+    int nfds;                   // 0 for a device waited for with ready_us()
+    int ready;                  // an event arrived on one of the descriptors
+} loop_dev_t;
+
+typedef struct
+{
+    int epfd;                   // shared by the pipelines of the loop
+    int array;                  // index of the pipeline in the tags
+    int owner;                  // processing runs in the loop too, nothing else touches the rings
+    int runs;
+    loop_dev_t playback;
+    loop_dev_t capture;
+    int fifo_in;                // playback FIFO
+    int dummy_fd;
+    int fifo_in_events;
+    int fifo_out;               // output FIFO, -1 until a reader opens it
+    int fifo_out_events;
+    double fifo_out_retry_us;
+    unsigned fifo_bytes;
+    unsigned zero_count;
+} evloop_t;
+
+// Write the played frames to the reference ring. When the loop owns both ends of the ring,
+// after a stall it drops the oldest frames rather than the newest, and the write index
+// stays in step with the playback clock. Otherwise the processing thread reads the other
+// end, and the newest frames are dropped.
+static void loop_reference_write(evloop_t *l, PaUtilRingBuffer *ring, const void *data, ring_buffer_size_t frames)
+{
+    ring_buffer_size_t space = PaUtil_GetRingBufferWriteAvailable(ring);
+    if (l->owner && space < frames)
+    {
+        PaUtil_AdvanceRingBufferReadIndex(ring, frames - space);
+    }
+    PaUtil_WriteRingBuffer(ring, data, frames);
+}
+
+static void loop_watch(evloop_t *l, int op, int fd, uint32_t events, uint32_t tag)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(l->epfd, op, fd, &ev) < 0)
     {
-        int count = 0;
+        fprintf(stderr, "epoll_ctl() failed, errno = %d\n", errno);
+        exit(1);
+    }
+}
 
-        for (int i = 0; i < 2; i++)
-        {
-            int result = read(fd, chunk + count, chunk_bytes - count);
-            if (result < 0)
-            {
-                if (errno != EAGAIN)
-                {
-                    fprintf(stderr, "read() returned %d, errno = %d\n", result, errno);
-                    exit(1);
-                }
-            }
-            else
-            {
-                count += result;
-            }
+static void loop_dev_watch(evloop_t *l, loop_dev_t *d, int kind)
+{
+    d->nfds = d->dev->ops->poll_fds(d->dev, d->pfds, MAX_PCM_POLL_FDS);
+    if (d->nfds < 0)
+    {
+        fprintf(stderr, "failed to get poll descriptors of %s\n", d->dev->name);
+        exit(1);
+    }
 
-            if (count >= chunk_bytes)
-            {
-                break;
-            }
+    for (int i = 0; i < d->nfds; i++)
+    {
+        d->pfds[i].revents = 0;
+        loop_watch(l, EPOLL_CTL_ADD, d->pfds[i].fd, d->pfds[i].events, LOOP_TAG(kind, l->array, i));
+    }
+}
+
+static void loop_dev_open(evloop_t *l, loop_dev_t *d, backend_t *dev, int kind)
+{
+    if (dev->ops->open(dev) < 0)
+    {
+        exit(1);
+    }
+    d->dev = dev;
+    loop_dev_watch(l, d, kind);
+
+    // a capture stream doesn't start by itself when it is polled
+    if (kind == LOOP_CAPTURE)
+    {
+        dev->ops->start(dev);
+    }
+}
+
+// Try to recover from an error, or reopen the device with its descriptors watched again
+static void loop_dev_recover(evloop_t *l, loop_dev_t *d, int kind, int err, conf_t *conf)
+{
+    audio_t *audio = conf->audio;
+    backend_t *dev = d->dev;
 
-            usleep(wait_us);
+    if (dev->ops->recover(dev, err) < 0)
+    {
+        for (int i = 0; i < d->nfds; i++)
+        {
+            epoll_ctl(l->epfd, EPOLL_CTL_DEL, d->pfds[i].fd, NULL);
         }
 
-        if (count < chunk_bytes)
+        int reopened = kind == LOOP_PLAYBACK ?
+                       device_reopen(dev, &audio->playback_ring, audio->stat_playback_reopens) :
+                       device_reopen(dev, &audio->capture_ring, audio->stat_capture_reopens);
+        if (reopened < 0)
         {
-            memset(chunk + count, 0, chunk_bytes - count);
+            d->dev = NULL;      // quitting
+            return;
+        }
+        loop_dev_watch(l, d, kind);
+    }
 
-            if (count)
-            {
-                printf("playback filled %d bytes zero\n", chunk_bytes - count);
-            }
+    if (kind == LOOP_CAPTURE)
+    {
+        dev->ops->start(dev);
+    }
+}
+
+static unsigned short loop_dev_revents(loop_dev_t *d)
+{
+    unsigned short revents = d->dev->ops->revents(d->dev, d->pfds, d->nfds);
+
+    for (int i = 0; i < d->nfds; i++)
+    {
+        d->pfds[i].revents = 0;
+    }
+    d->ready = 0;
+
+    return revents;
+}
+
+// microseconds until a device without descriptors has a transfer to do
+static int64_t loop_dev_wait(loop_dev_t *d)
+{
+    if (d->dev == NULL || d->nfds > 0)
+    {
+        return LOOP_TIMEOUT_MS * 1000;
+    }
+
+    return d->dev->ops->ready_us(d->dev);
+}
+
+// Fill all the room of the playback device from the jitter buffer, and copy what is played
+// to the playback ring buffer as the AEC reference. Return the frames written or an error.
+static long playback_transfer(evloop_t *l, conf_t *conf)
+{
+    audio_t *audio = conf->audio;
+    backend_t *dev = l->playback.dev;
+    long avail = dev->ops->avail(dev);
+    long done = 0;
+
+    while (done < avail)
+    {
+        char *area;
+        long frames = dev->ops->begin(dev, &area, avail - done);
+        if (frames <= 0)
+        {
+            return frames < 0 ? frames : done;
         }
 
-        if (0 == count)
+        unsigned count = playback_pull(conf, &audio->jitter, area, frames);
+        update_bypass(conf, count, frames, &l->zero_count);
+
+        long committed = dev->ops->commit(dev, frames);
+        if (committed < 0)
         {
-            // bypass AEC when no playback
-            if (zero_count > (conf->filter_length + conf->buffer_size))
-            {
-                if (!conf->bypass)
-                {
-                    conf->bypass = 1;
-                    printf("No playback, bypass AEC\n");
-                }
-            }
-            else
-            {
-                zero_count += chunk_size;
-            }
+            return committed;
         }
-        else
+        loop_reference_write(l, &audio->playback_ring, area, committed);
+        done += committed;
+
+        // a short write, the rest of the area is lost
+        if (committed < frames)
         {
-            if (conf->bypass)
-            {
-                conf->bypass = 0;
-                zero_count = 0;
-                printf("Enable AEC\n");
-            }
+            break;
         }
+    }
 
-        count = chunk_size;
-        char *data = (char *)chunk;
-        while (count > 0 && !g_is_quit)
+    return avail < 0 ? avail : done;
+}
+
+// Move what the capture device has into the capture ring buffer. Return the frames read or an error.
+static long capture_transfer(conf_t *conf, backend_t *dev)
+{
+    audio_t *audio = conf->audio;
+    PaUtilRingBuffer *ring = &audio->capture_ring;
+    long avail = dev->ops->avail(dev);
+    long done = 0;
+
+    while (done < avail)
+    {
+        char *area;
+        void *data1, *data2;
+        ring_buffer_size_t size1, size2;
+
+        long frames = dev->ops->begin(dev, &area, avail - done);
+        if (frames <= 0)
         {
-            ssize_t r;
-            if (mmap)
-            {
-                r = snd_pcm_mmap_writei(handle, data, count);
-            }
-            else
-            {
-                r = snd_pcm_writei(handle, data, count);
-            }
+            return frames < 0 ? frames : done;
+        }
 
-            if (r == -EAGAIN || (r >= 0 && (size_t)r < count))
-            {
-                fprintf(stderr, "w playback read error: %s\n", snd_strerror(r));
-                snd_pcm_wait(handle, 100);
-            }
-            else if (r < 0)
-            {
-                fprintf(stderr, "playback read error: %s\n", snd_strerror(r));
-                if (xrun_recovery(handle, r) < 0)
-                {
-                    exit(1);
-                }
-            }
-            if (r > 0)
-            {
-                PaUtil_WriteRingBuffer(&g_playback_ringbuffer, data, r);
-                count -= r;
-                data += r * frame_bytes;
-            }
+        ring_buffer_size_t written = PaUtil_GetRingBufferWriteRegions(ring, frames, &data1, &size1, &data2, &size2);
+        memcpy(data1, area, size1 * ring->elementSizeBytes);
+        if (size2 > 0)
+        {
+            memcpy(data2, area + size1 * ring->elementSizeBytes, size2 * ring->elementSizeBytes);
+        }
+        PaUtil_AdvanceRingBufferWriteIndex(ring, written);
+        if (written < frames)
+        {
+            printf("lost %ld frames\n", frames - written);
+            stats_add(audio->stat_lost, frames - written);
         }
+
+        long committed = dev->ops->commit(dev, frames);
+        if (committed < 0)
+        {
+            return committed;
+        }
+        done += committed;
     }
 
-    snd_pcm_close(handle);
-    free(chunk);
+    return avail < 0 ? avail : done;
+}
+
+static void loop_playback(evloop_t *l, conf_t *conf)
+{
+    audio_t *audio = conf->audio;
+    loop_dev_t *d = &l->playback;
+    long r;
 
-    return NULL;
+    unsigned short revents = loop_dev_revents(d);
+    if (revents & (POLLERR | POLLNVAL))
+    {
+        r = -EPIPE;
+        fprintf(stderr, "playback poll error\n");
+    }
+    else if (!(revents & POLLOUT))
+    {
+        return;
+    }
+    else
+    {
+        TRACE_BEGIN("pcm_write");
+        r = playback_transfer(l, conf);
+        TRACE_END("pcm_write");
+        if (r < 0)
+        {
+            fprintf(stderr, "playback write error: %s\n", strerror(-r));
+        }
+    }
+
+    if (r > 0)
+    {
+        hw_clock_update(&audio->playback_clock, d->dev, &audio->playback_ring, audio->stat_playback_delay);
+    }
+    else if (r < 0)
+    {
+        loop_dev_recover(l, d, LOOP_PLAYBACK, r, conf);
+    }
 }
 
-void *capture(void *ptr)
+// return the frames captured
+static long loop_capture(evloop_t *l, conf_t *conf)
 {
-    snd_pcm_hw_params_t *hw_params = NULL;
-    int err;
-    unsigned frame_bytes;
-    void *chunk = NULL;
-    snd_pcm_t *handle;
-    unsigned chunk_size = 1024;
-    conf_t *conf = (conf_t *)ptr;
-    int mmap = 0;
+    audio_t *audio = conf->audio;
+    loop_dev_t *d = &l->capture;
+    long r;
 
-    if ((err = snd_pcm_open(&handle, conf->rec_pcm, SND_PCM_STREAM_CAPTURE, 0)) < 0)
+    unsigned short revents = loop_dev_revents(d);
+    if (revents & (POLLERR | POLLNVAL))
     {
-        fprintf(stderr, "cannot open audio device %s (%s)\n",
-                conf->rec_pcm,
-                snd_strerror(err));
-        exit(1);
+        r = -EPIPE;
+    }
+    else if (!(revents & POLLIN))
+    {
+        return 0;
+    }
+    else
+    {
+        TRACE_BEGIN("pcm_read");
+        r = capture_transfer(conf, d->dev);
+        TRACE_END("pcm_read");
     }
 
-    mmap = set_params(handle, hw_params, conf->rate, conf->rec_channels, chunk_size * 2);
+    if (r > 0)
+    {
+        hw_clock_update(&audio->capture_clock, d->dev, &audio->capture_ring, audio->stat_capture_delay);
+    }
+    else if (r < 0)
+    {
+        fprintf(stderr, "read error: %s\n", strerror(-r));
+        loop_dev_recover(l, d, LOOP_CAPTURE, r, conf);
+    }
 
-    frame_bytes = conf->rec_channels * 2;
-    chunk = malloc(chunk_size * frame_bytes);
-    if (chunk == NULL)
+    return r;
+}
+
+// Open what `runs` asks for of a pipeline and watch it. A pipeline without a reference
+// device, as with a loopback channel, only has its capture device.
+static void loop_open(evloop_t *l, int epfd, int array, int runs, int owner, conf_t *conf)
+{
+    audio_t *audio = conf->audio;
+    unsigned frame_bytes = conf->ref_channels * 2;
+
+    memset(l, 0, sizeof(*l));
+    l->epfd = epfd;
+    l->array = array;
+    l->owner = owner;
+    l->runs = runs;
+    l->fifo_in = -1;
+    l->dummy_fd = -1;
+    l->fifo_out = -1;
+
+    if ((runs & RUN_PLAYBACK) && audio->playback_ring.buffer)
     {
-        fprintf(stderr, "not enough memory\n");
-        exit(1);
+        l->fifo_in = playback_fifo_open(conf, CHUNK_SIZE * frame_bytes, &l->dummy_fd);
+        l->fifo_in_events = EPOLLIN;
+        loop_watch(l, EPOLL_CTL_ADD, l->fifo_in, l->fifo_in_events, LOOP_TAG(LOOP_FIFO_IN, array, 0));
+
+        loop_dev_open(l, &l->playback, audio->playback_dev, LOOP_PLAYBACK);
     }
 
-    while (!g_is_quit)
+    if (runs & RUN_CAPTURE)
     {
-        ssize_t r;
-        if (mmap)
+        loop_dev_open(l, &l->capture, audio->capture_dev, LOOP_CAPTURE);
+    }
+}
+
+// Watch the playback FIFO while the jitter buffer has room and the output FIFO once a reader
+// opens it. Return microseconds until a device without descriptors is due.
+static int64_t loop_prepare(evloop_t *l, conf_t *conf)
+{
+    if (l->fifo_in >= 0)
+    {
+        // stop reading when the jitter buffer is full, the pipe then applies backpressure
+        jitter_t *jb = &conf->audio->jitter;
+        unsigned buffered = PaUtil_GetRingBufferReadAvailable(&jb->ring) + l->fifo_bytes / (conf->ref_channels * 2);
+        int fifo_in_events = buffered < jb->target + CHUNK_SIZE ? EPOLLIN : 0;
+        if (fifo_in_events != l->fifo_in_events)
+        {
+            l->fifo_in_events = fifo_in_events;
+            loop_watch(l, EPOLL_CTL_MOD, l->fifo_in, fifo_in_events, LOOP_TAG(LOOP_FIFO_IN, l->array, 0));
+        }
+    }
+
+    if ((l->runs & RUN_OUTPUT) && l->fifo_out < 0 && now_us() >= l->fifo_out_retry_us)
+    {
+        l->fifo_out = fifo_loop_open(conf);
+        if (l->fifo_out >= 0)
         {
-            r = snd_pcm_mmap_readi(handle, chunk, chunk_size);
+            l->fifo_out_events = EPOLLOUT;
+            loop_watch(l, EPOLL_CTL_ADD, l->fifo_out, l->fifo_out_events, LOOP_TAG(LOOP_FIFO_OUT, l->array, 0));
         }
         else
         {
-            r = snd_pcm_readi(handle, chunk, chunk_size);
+            l->fifo_out_retry_us = now_us() + LOOP_TIMEOUT_MS * 1000;
+        }
+    }
+
+    int64_t playback_wait = loop_dev_wait(&l->playback);
+    int64_t capture_wait = loop_dev_wait(&l->capture);
+
+    return playback_wait < capture_wait ? playback_wait : capture_wait;
+}
+
+// Transfer what the events made ready, process the captured frames, or hand them to the
+// processing thread, and write the output FIFO
+static void loop_service(evloop_t *l, conf_t *conf, int (*process)(void *arg), void *arg)
+{
+    unsigned frame_size = conf->rate * conf->frame_ms / 1000;
+    long captured = 0;
+
+    // a device without descriptors tells by its revents if it is due
+    if (l->playback.dev && (l->playback.ready || l->playback.nfds == 0))
+    {
+        loop_playback(l, conf);
+    }
+    if (l->capture.dev && (l->capture.ready || l->capture.nfds == 0))
+    {
+        captured = loop_capture(l, conf);
+    }
+
+    if (process)
+    {
+        // nothing is read while processing, keep the backlog to what a batch can drain
+        for (int i = 0; i < LOOP_BATCHES && capture_available(conf) >= (int)frame_size && !g_is_quit; i++)
+        {
+            // 0 when a realignment dropped frames, the loop condition then sees what is left
+            process(arg);
         }
-        if (r == -EAGAIN || (r >= 0 && (size_t)r < chunk_size))
+    }
+    else if (captured > 0 && conf->capture_notify)
+    {
+        conf->capture_notify(conf->capture_notify_arg);
+    }
+
+    if (l->fifo_out >= 0)
+    {
+        int left = fifo_loop_write(conf, l->fifo_out);
+        if (left < 0)
         {
-            fprintf(stderr, "1 read error: %s\n", snd_strerror(r));
-            snd_pcm_wait(handle, 100);
+            // the reader has gone, wait for the next one
+            epoll_ctl(l->epfd, EPOLL_CTL_DEL, l->fifo_out, NULL);
+            close(l->fifo_out);
+            l->fifo_out = -1;
         }
-        else if (r < 0)
+        else if ((left ? EPOLLOUT : 0) != l->fifo_out_events)
         {
-            fprintf(stderr, "read error: %s\n", snd_strerror(r));
-            if (xrun_recovery(handle, r) < 0)
+            l->fifo_out_events = left ? EPOLLOUT : 0;
+            loop_watch(l, EPOLL_CTL_MOD, l->fifo_out, l->fifo_out_events, LOOP_TAG(LOOP_FIFO_OUT, l->array, 0));
+        }
+    }
+}
+
+static void loop_close(evloop_t *l, conf_t *conf)
+{
+    if (l->fifo_in >= 0)
+    {
+        int named = conf->name && conf->name[0];
+        printf("%s%splayback underruns: %u\n", named ? conf->name : "", named ? ": " : "",
+               conf->audio->jitter.underruns);
+    }
+
+    if (l->playback.dev)
+    {
+        l->playback.dev->ops->close(l->playback.dev);
+    }
+    if (l->capture.dev)
+    {
+        l->capture.dev->ops->close(l->capture.dev);
+    }
+    if (l->fifo_out >= 0)
+    {
+        close(l->fifo_out);
+    }
+    if (l->fifo_in >= 0)
+    {
+        close(l->dummy_fd);
+        close(l->fifo_in);
+    }
+}
+
+// Run what `runs` asks for of `count` pipelines from one epoll loop until quit, see audio_loop_arrays()
+static void loop_run(conf_t **confs, int count, int runs, int (*process)(void *arg), void *arg)
+{
+    evloop_t loops[LOOP_ARRAYS];
+    struct epoll_event events[LOOP_EVENTS];
+
+    if (count > LOOP_ARRAYS)
+    {
+        fprintf(stderr, "one loop runs at most %d pipelines\n", LOOP_ARRAYS);
+        exit(1);
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        fprintf(stderr, "epoll_create1() failed, errno = %d\n", errno);
+        exit(1);
+    }
+
+    for (int a = 0; a < count; a++)
+    {
+        loop_open(&loops[a], epfd, a, runs, process != NULL, confs[a]);
+    }
+
+    while (!g_is_quit)
+    {
+        int64_t wait_us = LOOP_TIMEOUT_MS * 1000;
+        for (int a = 0; a < count; a++)
+        {
+            int64_t wait = loop_prepare(&loops[a], confs[a]);
+            if (wait < wait_us)
+            {
+                wait_us = wait;
+            }
+        }
+
+        TRACE_BEGIN("loop_wait");
+        int n = epoll_wait(epfd, events, LOOP_EVENTS, (wait_us + 999) / 1000);
+        TRACE_END("loop_wait");
+        if (n < 0)
+        {
+            if (errno == EINTR)
             {
-                exit(1);
+                continue;
             }
+            fprintf(stderr, "epoll_wait() failed, errno = %d\n", errno);
+            exit(1);
         }
 
-        if (r > 0)
+        for (int i = 0; i < n; i++)
         {
-            ring_buffer_size_t written =
-                PaUtil_WriteRingBuffer(&g_capture_ringbuffer, chunk, r);
-            if (written < (r))
+            int kind = events[i].data.u32 >> 16;
+            evloop_t *l = &loops[(events[i].data.u32 >> 8) & 0xFF];
+            conf_t *conf = confs[l->array];
+            int index = events[i].data.u32 & 0xFF;
+
+            if (kind == LOOP_FIFO_IN)
+            {
+                playback_fifo_read(l->fifo_in, &conf->audio->jitter, conf->audio->playback_fifo_buf,
+                                   &l->fifo_bytes, conf->ref_channels * 2, CHUNK_SIZE);
+            }
+            else if (kind == LOOP_PLAYBACK)
+            {
+                l->playback.pfds[index].revents = events[i].events;
+                l->playback.ready = 1;
+            }
+            else if (kind == LOOP_CAPTURE)
             {
-                printf("lost %ld frames\n", r - written);
+                l->capture.pfds[index].revents = events[i].events;
+                l->capture.ready = 1;
             }
         }
+
+        for (int a = 0; a < count; a++)
+        {
+            loop_service(&loops[a], confs[a], process, arg);
+        }
     }
 
-    snd_pcm_close(handle);
-    free(chunk);
+    for (int a = 0; a < count; a++)
+    {
+        loop_close(&loops[a], confs[a]);
+    }
+    close(epfd);
+}
+
+// threaded mode, the playback FIFO and device of a pipeline
+static void *playback(void *ptr)
+{
+    conf_t *conf = (conf_t *)ptr;
+
+    trace_thread("playback");
+    loop_run(&conf, 1, RUN_PLAYBACK, NULL, NULL);
 
     return NULL;
 }
 
-int capture_start(conf_t *conf)
+// threaded mode, the capture device, conf->capture_notify tells the processing thread
+static void *capture(void *ptr)
 {
-    unsigned buffer_size = power2(conf->buffer_size);
-    unsigned buffer_bytes = conf->rec_channels * conf->bits_per_sample / 8;
+    conf_t *conf = (conf_t *)ptr;
+
+    trace_thread("capture");
+    loop_run(&conf, 1, RUN_CAPTURE, NULL, NULL);
 
-    void *buf = calloc(buffer_size, buffer_bytes);
-    if (buf == NULL)
+    return NULL;
+}
+
+// Single thread mode: run the devices, the playback and output FIFOs of `count` pipelines
+// from one epoll loop until quit. With `process`, called for every frame captured by the
+// only pipeline, the ring buffers and the jitter buffer are only touched by this thread, so
+// nothing waits for or wakes another thread. Without it, conf->capture_notify of each
+// pipeline hands its frames to processing threads.
+// capture_start(), playback_start() and fifo_setup() are called first with
+// conf->single_thread set, and start no threads.
+void audio_loop_arrays(conf_t **confs, int count, int (*process)(void *arg), void *arg)
+{
+    trace_thread("loop");
+    loop_run(confs, count, RUN_ALL, process, arg);
+}
+
+void audio_loop(conf_t *conf, int (*process)(void *arg), void *arg)
+{
+    audio_loop_arrays(&conf, 1, process, arg);
+}
+
+// capture and playback of a pipeline share one state
+static audio_t *audio_get(conf_t *conf)
+{
+    if (conf->audio == NULL)
     {
-        fprintf(stderr, "Fail to allocate memory.\n");
-        exit(1);
+        audio_t *audio = arena_alloc("audio state", sizeof(audio_t));
+        stats_name(audio->stat_lost, sizeof(audio->stat_lost), conf->name, "capture_lost_frames");
+        stats_name(audio->stat_underruns, sizeof(audio->stat_underruns), conf->name, "playback_underruns");
+        stats_name(audio->stat_capture_reopens, sizeof(audio->stat_capture_reopens), conf->name, "capture_reopens");
+        stats_name(audio->stat_playback_reopens, sizeof(audio->stat_playback_reopens), conf->name, "playback_reopens");
+        stats_name(audio->stat_playback_delay, sizeof(audio->stat_playback_delay), conf->name, "playback_delay_frames");
+        stats_name(audio->stat_capture_delay, sizeof(audio->stat_capture_delay), conf->name, "capture_delay_frames");
+        stats_name(audio->stat_align_error, sizeof(audio->stat_align_error), conf->name, "align_error_frames");
+        stats_name(audio->stat_align_corrections, sizeof(audio->stat_align_corrections), conf->name, "align_corrections");
+        stats_name(audio->stat_bypass_transitions, sizeof(audio->stat_bypass_transitions), conf->name, "bypass_transitions");
+        conf->audio = audio;
     }
 
-    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(&g_capture_ringbuffer, buffer_bytes, buffer_size, buf);
-    if (ret == -1)
+    return conf->audio;
+}
+
+// Set up the backend of a device, the thread that runs it opens it
+static backend_t *device_create(const char *name, int playback, unsigned rate, unsigned channels,
+                                unsigned buffer_size)
+{
+    backend_t *dev = arena_alloc("audio state", sizeof(backend_t));
+
+    dev->ops = simdev_ops(name);
+    if (dev->ops == NULL)
+    {
+        dev->ops = &g_alsa_ops;
+    }
+    dev->name = name;
+    dev->playback = playback;
+    dev->rate = rate;
+    dev->channels = channels;
+    dev->buffer_size = buffer_size;
+    dev->chunk_size = CHUNK_SIZE;
+    dev->chunk = arena_alloc(playback ? "playback chunk" : "capture chunk", CHUNK_SIZE * channels * 2);
+    if (dev->ops->init(dev) < 0)
     {
-        fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
         exit(1);
     }
 
-    pthread_create(&g_capture_thread, NULL, capture, conf);
+    return dev;
+}
+
+// Frames a ring needs besides what it holds for its own purpose: one device transfer, a
+// batch of the AEC catching up, and RING_SLACK_MS of stalls and alignment corrections
+static unsigned ring_headroom(conf_t *conf)
+{
+    return CHUNK_SIZE + conf->max_batch * conf->rate * conf->frame_ms / 1000 + conf->rate * RING_SLACK_MS / 1000;
+}
+
+int capture_start(conf_t *conf)
+{
+    audio_t *audio = audio_get(conf);
+    // the startup delay is skipped as it arrives, see capture_skip()
+    unsigned buffer_size = power2(conf->buffer_size ? conf->buffer_size : ring_headroom(conf));
+    unsigned buffer_bytes = conf->rec_channels * conf->bits_per_sample / 8;
+
+    audio->capture_mirrored = ring_init(&audio->capture_ring, "capture ring", buffer_bytes, buffer_size);
+    audio->capture_dev = device_create(conf->rec_pcm, 0, conf->rate, conf->rec_channels, CHUNK_SIZE * 4);
+
+    // in single thread mode audio_loop() opens and runs the device
+    if (conf->single_thread)
+    {
+        return 0;
+    }
+
+    pthread_create(&audio->capture_thread, NULL, capture, conf);
 
     return 0;
 }
 
 int playback_start(conf_t *conf)
 {
-    unsigned buffer_size = power2(conf->buffer_size);
+    audio_t *audio = audio_get(conf);
+    // the reference is taken as it is written to the device, so it waits for the matching
+    // capture for the system delay plus the device buffer
+    unsigned needed = conf->delay + CHUNK_SIZE * 2 + ring_headroom(conf);
+    unsigned buffer_size = power2(conf->buffer_size ? conf->buffer_size : needed);
     unsigned buffer_bytes = conf->ref_channels * conf->bits_per_sample / 8;
 
-    void *buf = calloc(buffer_size, buffer_bytes);
-    if (buf == NULL)
-    {
-        fprintf(stderr, "Fail to allocate memory.\n");
-        exit(1);
-    }
+    audio->playback_mirrored = ring_init(&audio->playback_ring, "playback ring", buffer_bytes, buffer_size);
+    audio->playback_dev = device_create(conf->out_pcm, 1, conf->rate, conf->ref_channels, CHUNK_SIZE * 2);
+    audio->playback_fifo_buf = arena_alloc("playback fifo buffer", CHUNK_SIZE * buffer_bytes);
+    jitter_init(&audio->jitter, conf->rate, buffer_bytes, CHUNK_SIZE);
+    audio->jitter.stat_underruns = audio->stat_underruns;
 
-    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(&g_playback_ringbuffer, buffer_bytes, buffer_size, buf);
-    if (ret == -1)
+    if (conf->single_thread)
     {
-        fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
-        exit(1);
+        return 0;
     }
 
-    pthread_create(&g_playback_thread, NULL, playback, conf);
+    pthread_create(&audio->playback_thread, NULL, playback, conf);
 
     return 0;
 }
 
-int capture_stop()
+int capture_stop(conf_t *conf)
 {
     void *ret = NULL;
-    pthread_join(g_capture_thread, &ret);
-
-    free(g_capture_ringbuffer.buffer);
+    if (!conf->single_thread)
+    {
+        pthread_join(conf->audio->capture_thread, &ret);
+    }
 
     return 0;
 }
 
-int playback_stop()
+int playback_stop(conf_t *conf)
 {
     void *ret = NULL;
-    pthread_join(g_playback_thread, &ret);
-
-    free(g_playback_ringbuffer.buffer);
+    if (!conf->single_thread)
+    {
+        pthread_join(conf->audio->playback_thread, &ret);
+    }
 
     return 0;
 }
 
-int capture_read(void *buf, size_t frames, int timeout_ms)
+// return 1 if `frames` frames are in the capture ring within the timeout
+static int capture_wait(PaUtilRingBuffer *ring, size_t frames, int timeout_ms)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_capture_ringbuffer) < frames && timeout_ms > 0)
+    TRACE_BEGIN("capture_wait");
+    while (PaUtil_GetRingBufferReadAvailable(ring) < frames && timeout_ms > 0)
     {
         usleep(10);
         timeout_ms--;
     }
+    TRACE_END("capture_wait");
 
-    return PaUtil_ReadRingBuffer(&g_capture_ringbuffer, buf, frames);
+    return PaUtil_GetRingBufferReadAvailable(ring) >= frames;
 }
 
-int capture_skip(size_t frames)
+int capture_read(conf_t *conf, void *buf, size_t frames, int timeout_ms)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_capture_ringbuffer) < frames)
+    PaUtilRingBuffer *ring = &conf->audio->capture_ring;
+
+    // leave a partial frame in the ring, e.g. while the device is being reopened
+    if (!capture_wait(ring, frames, timeout_ms))
     {
-        usleep(1000);
+        return 0;
     }
-    return PaUtil_AdvanceRingBufferReadIndex(&g_capture_ringbuffer, frames);
+
+    return PaUtil_ReadRingBuffer(ring, buf, frames);
 }
 
-int playback_read(void *buf, size_t frames, int timeout_ms)
+// Read `frames` frames in place from a mirrored capture ring. They stay in the ring, where
+// the capture thread can't overwrite them, until capture_release().
+// Return NULL if no audio arrived within the timeout.
+const void *capture_peek(conf_t *conf, size_t frames, int timeout_ms)
 {
-    while (PaUtil_GetRingBufferReadAvailable(&g_playback_ringbuffer) < frames && timeout_ms > 0)
+    PaUtilRingBuffer *ring = &conf->audio->capture_ring;
+    void *data;
+
+    if (!capture_wait(ring, frames, timeout_ms))
+    {
+        return NULL;
+    }
+    ring_read_window(ring, 1, frames, &data);
+
+    return data;
+}
+
+void capture_release(conf_t *conf, size_t frames)
+{
+    PaUtil_AdvanceRingBufferReadIndex(&conf->audio->capture_ring, frames);
+}
+
+int capture_mirrored(conf_t *conf)
+{
+    return conf->audio->capture_mirrored;
+}
+
+int capture_available(conf_t *conf)
+{
+    return PaUtil_GetRingBufferReadAvailable(&conf->audio->capture_ring);
+}
+
+// Drop `frames` frames of capture as they arrive, so the ring doesn't have to hold them.
+// Return the number of frames dropped, fewer on quit.
+int capture_skip(conf_t *conf, size_t frames)
+{
+    PaUtilRingBuffer *ring = &conf->audio->capture_ring;
+    size_t skipped = 0;
+
+    while (skipped < frames && !g_is_quit)
+    {
+        size_t available = PaUtil_GetRingBufferReadAvailable(ring);
+        if (available > frames - skipped)
+        {
+            available = frames - skipped;
+        }
+        PaUtil_AdvanceRingBufferReadIndex(ring, available);
+        skipped += available;
+        if (skipped < frames)
+        {
+            usleep(1000);
+        }
+    }
+
+    return skipped;
+}
+
+// return 1 if `frames` frames are in the playback ring within the timeout
+static int playback_wait(PaUtilRingBuffer *ring, size_t frames, int timeout_ms)
+{
+    TRACE_BEGIN("playback_wait");
+    while (PaUtil_GetRingBufferReadAvailable(ring) < frames && timeout_ms > 0)
     {
         usleep(1000);
         timeout_ms--;
     }
+    TRACE_END("playback_wait");
+
+    return PaUtil_GetRingBufferReadAvailable(ring) >= frames;
+}
+
+int playback_read(conf_t *conf, void *buf, size_t frames, int timeout_ms)
+{
+    PaUtilRingBuffer *ring = &conf->audio->playback_ring;
+
+    playback_wait(ring, frames, timeout_ms);
+
+    size_t count = PaUtil_ReadRingBuffer(ring, buf, frames);
+    if (count < frames)
+    {
+        memset((char *)buf + count * ring->elementSizeBytes, 0,
+               (frames - count) * ring->elementSizeBytes);
+    }
+
+    return count;
+}
+
+// Read `frames` reference frames in place from a mirrored playback ring, until playback_release().
+// Return NULL if fewer arrived within the timeout, then playback_read() pads them with silence.
+const void *playback_peek(conf_t *conf, size_t frames, int timeout_ms)
+{
+    PaUtilRingBuffer *ring = &conf->audio->playback_ring;
+    void *data;
+
+    if (!playback_wait(ring, frames, timeout_ms))
+    {
+        return NULL;
+    }
+    ring_read_window(ring, 1, frames, &data);
+
+    return data;
+}
+
+void playback_release(conf_t *conf, size_t frames)
+{
+    PaUtil_AdvanceRingBufferReadIndex(&conf->audio->playback_ring, frames);
+}
+
+int playback_mirrored(conf_t *conf)
+{
+    return conf->audio->playback_mirrored;
+}
+
+// Drop up to `frames` captured frames and as many reference frames, so both stay aligned while
+// nothing is processed. Return the number of captured frames dropped.
+int audio_drop(conf_t *conf, size_t frames)
+{
+    audio_t *audio = conf->audio;
+    ring_buffer_size_t available = PaUtil_GetRingBufferReadAvailable(&audio->capture_ring);
+    ring_buffer_size_t count = frames < (size_t)available ? frames : available;
+
+    PaUtil_AdvanceRingBufferReadIndex(&audio->capture_ring, count);
+
+    // no playback ring when the reference is in loopback channels
+    if (audio->playback_ring.buffer)
+    {
+        available = PaUtil_GetRingBufferReadAvailable(&audio->playback_ring);
+        PaUtil_AdvanceRingBufferReadIndex(&audio->playback_ring, count < available ? count : available);
+    }
+
+    return count;
+}
+
+// Keep the capture and reference read positions at a constant offset in converter time,
+// so the echo stays where the filter converged to when a device drifts or recovers from
+// an xrun. The offset measured once the startup delay is skipped is the target.
+// Called by the processing thread before reading a batch.
+void audio_align(conf_t *conf)
+{
+    audio_t *audio = conf->audio;
+    int64_t capture_us, playback_us;
+    ring_buffer_size_t capture_index, playback_index;
+
+    if (!hw_clock_read(&audio->capture_clock, &capture_us, &capture_index) ||
+        !hw_clock_read(&audio->playback_clock, &playback_us, &playback_index))
+    {
+        return;
+    }
+
+    // converter time of the next frame to be read from each ring, as a difference in frames
+    double offset = (double)(capture_us - playback_us) * conf->rate / 1000000
+                    + ring_distance(&audio->capture_ring, audio->capture_ring.readIndex, capture_index)
+                    - ring_distance(&audio->playback_ring, audio->playback_ring.readIndex, playback_index);
+
+    double step = conf->rate * ALIGN_STEP_MS / 1000.0;
+    if (audio->align_updates == 0 || fabs(offset - audio->align_offset) > step)
+    {
+        audio->align_offset = offset;
+    }
+    else
+    {
+        audio->align_offset += (offset - audio->align_offset) / ALIGN_SMOOTHING;
+    }
+
+    if (audio->align_updates < ALIGN_SETTLE)
+    {
+        if (++audio->align_updates == ALIGN_SETTLE)
+        {
+            audio->align_target = audio->align_offset;
+            printf("capture is %.1f ms behind the reference at the converters\n",
+                   audio->align_target * 1000 / conf->rate);
+        }
+        return;
+    }
+
+    // positive when capture runs ahead of the reference, drop reference frames to catch up
+    long error = lround(audio->align_offset - audio->align_target);
+    stats_set(audio->stat_align_error, error);
+
+    if (labs(error) < (long)(conf->rate * ALIGN_TOLERANCE_MS / 1000))
+    {
+        return;
+    }
+
+    // never wait for frames, the ring may be smaller than the error
+    if (error > 0)
+    {
+        ring_buffer_size_t available = PaUtil_GetRingBufferReadAvailable(&audio->playback_ring);
+        error = error < available ? error : available;
+        PaUtil_AdvanceRingBufferReadIndex(&audio->playback_ring, error);
+    }
+    else
+    {
+        ring_buffer_size_t available = PaUtil_GetRingBufferReadAvailable(&audio->capture_ring);
+        error = -error < available ? error : -available;
+        PaUtil_AdvanceRingBufferReadIndex(&audio->capture_ring, -error);
+    }
 
-    return PaUtil_ReadRingBuffer(&g_playback_ringbuffer, buf, frames);
+    audio->align_offset -= error;
+    audio->align_corrections++;
+    stats_set(audio->stat_align_corrections, audio->align_corrections);
+    printf("realign capture and reference by %ld frames\n", error);
 }
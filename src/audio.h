@@ -1,17 +1,30 @@
-
 #ifndef _AUDIO_H_
 #define _AUDIO_H_
 
+#include <stddef.h>
+
 #include "conf.h"
 
 
 int capture_start(conf_t *conf);
-int capture_stop();
-int capture_read(void *buf, size_t frames, int timeout_ms);
-int capture_skip(size_t frames);
+int capture_stop(conf_t *conf);
+int capture_read(conf_t *conf, void *buf, size_t frames, int timeout_ms);
+int capture_skip(conf_t *conf, size_t frames);
+int capture_available(conf_t *conf);
+const void *capture_peek(conf_t *conf, size_t frames, int timeout_ms);
+void capture_release(conf_t *conf, size_t frames);
+int capture_mirrored(conf_t *conf);
 
 int playback_start(conf_t *conf);
-int playback_stop();
-int playback_read(void *buf, size_t frames, int timeout_ms);
+int playback_stop(conf_t *conf);
+int playback_read(conf_t *conf, void *buf, size_t frames, int timeout_ms);
+const void *playback_peek(conf_t *conf, size_t frames, int timeout_ms);
+void playback_release(conf_t *conf, size_t frames);
+int playback_mirrored(conf_t *conf);
+
+int audio_drop(conf_t *conf, size_t frames);
+void audio_align(conf_t *conf);
+void audio_loop(conf_t *conf, int (*process)(void *arg), void *arg);
+void audio_loop_arrays(conf_t **confs, int count, int (*process)(void *arg), void *arg);
 
 #endif // _AUDIO_H_
@@ -0,0 +1,58 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <poll.h>
+#include <stdint.h>
+
+// Audio device backends: ALSA PCMs, see alsa.c, and the simulated null, file and loop
+// devices, see simdev.c. The device threads and the event loop of audio.c drive all of
+// them the same way, through the operations below.
+
+typedef struct _backend_ops_t backend_ops_t;
+
+typedef struct
+{
+    const backend_ops_t *ops;
+    const char *name;           // PCM name, or the simulated device with its options
+    int playback;
+    unsigned rate;
+    unsigned channels;
+    unsigned buffer_size;       // frames of the device buffer
+    unsigned chunk_size;        // frames of chunk
+    char *chunk;                // transfers of a device that isn't mapped go through it
+    void *state;                // of the backend
+} backend_t;
+
+struct _backend_ops_t
+{
+    // allocate the backend state, at startup
+    int (*init)(backend_t *dev);
+    // open the device, also again after close(), return a negative error code on failure
+    int (*open)(backend_t *dev);
+    void (*close)(backend_t *dev);
+    // start a prepared stream, which a capture stream or an mmap transfer doesn't do
+    int (*start)(backend_t *dev);
+
+    // descriptors to wait on for a transfer, 0 if the device is waited for with ready_us()
+    int (*poll_fds)(backend_t *dev, struct pollfd *pfds, int space);
+    // POLLIN, POLLOUT or POLLERR of the device after the descriptors were polled
+    unsigned short (*revents)(backend_t *dev, struct pollfd *pfds, int nfds);
+    // microseconds until a device without descriptors has a transfer to do, 0 if it has now
+    int64_t (*ready_us)(backend_t *dev);
+
+    // frames that can be transferred without blocking, or a negative error code
+    long (*avail)(backend_t *dev);
+    // converter time of the next frame transferred and the frames queued in the device
+    int (*delay)(backend_t *dev, int64_t *time_us, long *frames);
+    // Get an area of up to `frames` contiguous frames to fill, or with the captured frames.
+    // Return the frames in it, 0 if there are none now, or a negative error code
+    long (*begin)(backend_t *dev, char **area, unsigned long frames);
+    // hand the frames of the area back, return the frames transferred or a negative error code
+    long (*commit)(backend_t *dev, unsigned long frames);
+    // recover from an xrun or suspend, a negative error code when the device has to be reopened
+    int (*recover)(backend_t *dev, int err);
+};
+
+extern const backend_ops_t g_alsa_ops;
+
+#endif // _BACKEND_H_
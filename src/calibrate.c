@@ -0,0 +1,259 @@
+// calibrate.c - playback to capture delay calibration
+//
+// A maximum length sequence (MLS) is written to the playback FIFO, so it goes through
+// the same jitter buffer and PCM as normal playback, and the played reference and the
+// capture are read back from the ring buffers. The lag of the cross-correlation peak is
+// the number of capture frames to skip to align them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "audio.h"
+#include "calibrate.h"
+#include "conf.h"
+
+#define MLS_ORDER 15                // x^15 + x^14 + 1, 32767 samples
+#define MLS_LENGTH ((1 << MLS_ORDER) - 1)
+#define MLS_AMPLITUDE 6000
+#define LEAD_MS 300                 // silence before the sequence, lets the jitter buffer start
+#define MARGIN_MS 2                 // keep the direct path inside the filter despite jitter
+#define MIN_PEAK_RATIO 8.0          // correlation peak over its average magnitude
+
+extern int g_is_quit;
+
+typedef struct
+{
+    int16_t *signal;                // played, interleaved with ref_channels
+    size_t signal_frames;
+    int16_t *rec;                   // first capture channel
+    int16_t *far;                   // first reference channel
+    size_t frames;
+    int16_t *rec_chunk;
+    int16_t *far_chunk;
+    size_t chunk;
+} calibrate_t;
+
+static calibrate_t g_calibrate;
+
+// the cache holds one "rec_pcm out_pcm rate delay" line per device pair
+int calibrate_load(conf_t *conf, const char *path)
+{
+    char rec_pcm[128], out_pcm[128];
+    unsigned rate;
+    int delay;
+    int result = -1;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (fscanf(fp, "%127s %127s %u %d", rec_pcm, out_pcm, &rate, &delay) == 4)
+    {
+        if (strcmp(rec_pcm, conf->rec_pcm) == 0 && strcmp(out_pcm, conf->out_pcm) == 0 && rate == conf->rate)
+        {
+            result = delay;
+        }
+    }
+    fclose(fp);
+
+    if (result >= 0)
+    {
+        printf("Delay %d frames for %s -> %s from %s\n", result, conf->out_pcm, conf->rec_pcm, path);
+    }
+
+    return result;
+}
+
+int calibrate_save(conf_t *conf, const char *path, int delay)
+{
+    char tmp[256];
+    char line[300];
+    char rec_pcm[128], out_pcm[128];
+    unsigned rate;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "failed to write %s\n", tmp);
+        return -1;
+    }
+
+    // keep the other device pairs
+    FILE *in = fopen(path, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            if (sscanf(line, "%127s %127s %u", rec_pcm, out_pcm, &rate) == 3 &&
+                !(strcmp(rec_pcm, conf->rec_pcm) == 0 && strcmp(out_pcm, conf->out_pcm) == 0 && rate == conf->rate))
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %s %u %d\n", conf->rec_pcm, conf->out_pcm, conf->rate, delay);
+    fclose(out);
+
+    return rename(tmp, path);
+}
+
+void calibrate_init(conf_t *conf)
+{
+    calibrate_t *c = &g_calibrate;
+    size_t lead = conf->rate * LEAD_MS / 1000;
+    size_t max_delay = conf->rate * CALIBRATE_MAX_DELAY_MS / 1000;
+
+    c->chunk = conf->rate / 100;
+    c->signal_frames = lead + MLS_LENGTH;
+    c->frames = c->signal_frames + max_delay + conf->rate / 2;
+
+    c->signal = (int16_t *)arena_alloc("calibration", c->signal_frames * conf->ref_channels * sizeof(int16_t));
+    c->rec = (int16_t *)arena_alloc("calibration", c->frames * sizeof(int16_t));
+    c->far = (int16_t *)arena_alloc("calibration", c->frames * sizeof(int16_t));
+    c->rec_chunk = (int16_t *)arena_alloc("calibration", c->chunk * conf->rec_channels * sizeof(int16_t));
+    c->far_chunk = (int16_t *)arena_alloc("calibration", c->chunk * conf->ref_channels * sizeof(int16_t));
+
+    unsigned state = 1;
+    for (size_t i = 0; i < MLS_LENGTH; i++)
+    {
+        unsigned bit = ((state >> 14) ^ (state >> 13)) & 1;
+        state = ((state << 1) | bit) & MLS_LENGTH;
+        for (unsigned ch = 0; ch < conf->ref_channels; ch++)
+        {
+            c->signal[(lead + i) * conf->ref_channels + ch] = bit ? MLS_AMPLITUDE : -MLS_AMPLITUDE;
+        }
+    }
+}
+
+// Play the sequence and return the delay in whole frames, or -1 if no clear echo was found
+// or on quit
+int calibrate_run(conf_t *conf)
+{
+    calibrate_t *c = &g_calibrate;
+    size_t max_delay = conf->rate * CALIBRATE_MAX_DELAY_MS / 1000;
+    size_t signal_bytes = c->signal_frames * conf->ref_channels * sizeof(int16_t);
+    size_t sent = 0;
+    size_t count = 0;
+
+    int fd = open(conf->playback_fifo, O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        fprintf(stderr, "failed to open %s\n", conf->playback_fifo);
+        return -1;
+    }
+
+    printf("Calibrating delay, keep the room quiet...\n");
+
+    while (count < c->frames && !g_is_quit)
+    {
+        if (sent < signal_bytes)
+        {
+            int r = write(fd, (char *)c->signal + sent, signal_bytes - sent);
+            if (r > 0)
+            {
+                sent += r;
+            }
+        }
+
+        if (capture_read(conf, c->rec_chunk, c->chunk, 200) < c->chunk)
+        {
+            continue;
+        }
+        playback_read(conf, c->far_chunk, c->chunk, 200);
+
+        for (size_t i = 0; i < c->chunk && count < c->frames; i++, count++)
+        {
+            c->rec[count] = c->rec_chunk[i * conf->rec_channels];
+            c->far[count] = c->far_chunk[i * conf->ref_channels];
+        }
+    }
+    close(fd);
+
+    if (g_is_quit)
+    {
+        return -1;
+    }
+
+    // the part of the reference that carries the sequence
+    size_t first = 0, last = count;
+    while (first < count && c->far[first] == 0)
+    {
+        first++;
+    }
+    while (last > first && c->far[last - 1] == 0)
+    {
+        last--;
+    }
+    if (last - first < MLS_LENGTH / 2)
+    {
+        printf("Calibration failed, the sequence was not played\n");
+        return -1;
+    }
+    if (last + max_delay + 1 > count)
+    {
+        last = count - max_delay - 1;
+    }
+
+    double best = 0, sum = 0, corr[3] = {0, 0, 0};
+    size_t lag = 0;
+    for (size_t l = 0; l <= max_delay; l++)
+    {
+        double acc = 0;
+        for (size_t n = first; n < last; n++)
+        {
+            acc += (double)c->far[n] * c->rec[n + l];
+        }
+        sum += fabs(acc);
+        if (fabs(acc) > fabs(best))
+        {
+            best = acc;
+            lag = l;
+        }
+    }
+
+    double ratio = fabs(best) / (sum / (max_delay + 1));
+    if (ratio < MIN_PEAK_RATIO)
+    {
+        printf("Calibration failed, no clear echo (peak ratio %.1f)\n", ratio);
+        return -1;
+    }
+
+    // parabolic interpolation between the neighbours of the peak
+    double fraction = 0;
+    if (lag > 0 && lag < max_delay)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            for (size_t n = first; n < last; n++)
+            {
+                corr[k] += (double)c->far[n] * c->rec[n + lag - 1 + k];
+            }
+        }
+        double d = corr[0] - 2 * corr[1] + corr[2];
+        if (d != 0)
+        {
+            fraction = 0.5 * (corr[0] - corr[2]) / d;
+        }
+    }
+
+    // only whole frames are skipped, the fraction is left to the echo filter, whose taps
+    // resolve it within the margin
+    int margin = conf->rate * MARGIN_MS / 1000;
+    int delay = lag > margin ? lag - margin : 0;
+
+    printf("Measured delay %.2f frames (%.2f ms, peak ratio %.1f), skip %d frames\n",
+           lag + fraction, (lag + fraction) * 1000 / conf->rate, ratio, delay);
+
+    return delay;
+}
@@ -0,0 +1,15 @@
+#ifndef _CALIBRATE_H_
+#define _CALIBRATE_H_
+
+#include "conf.h"
+
+// Measure the delay between playback and capture with a test sequence, cached per device pair
+
+#define CALIBRATE_MAX_DELAY_MS 500
+
+int calibrate_load(conf_t *conf, const char *path);
+int calibrate_save(conf_t *conf, const char *path, int delay);
+void calibrate_init(conf_t *conf);
+int calibrate_run(conf_t *conf);
+
+#endif // _CALIBRATE_H_
@@ -2,20 +2,47 @@
 #ifndef _CONF_H_
 #define _CONF_H_
 
+struct _audio_t;
+struct _fifo_t;
+struct _prompts_t;
+
 typedef struct _conf_t {
+    char *name;             // pipeline name, prefixes its metrics when there are several
     char *rec_pcm;          // recording PCM
     char *out_pcm;          // output PCM
     char *playback_fifo;    // playback FIFO
     char *out_fifo;         // AEC output FIFO
+    char *stats_file;       // metrics written every second
+    char *control_fifo;     // control commands, see control.c
     unsigned rate;
     unsigned rec_channels;  // recording channels
     unsigned ref_channels;  // reference (playback) channels
     unsigned out_channels;  // processed audio output channels
     unsigned bits_per_sample;
-    unsigned buffer_size;
+    unsigned frame_ms;      // AEC processing frame length in ms
+    unsigned max_batch;     // max AEC frames processed per wakeup when catching up
+    unsigned buffer_size;   // frames per ring buffer, 0 to fit each ring to what it has to hold
+    unsigned delay;         // system delay between playback and capture, held by the playback ring
     unsigned playback_fifo_size;
+    unsigned out_policy;    // FIFO_DROP_OLDEST, FIFO_DROP_NEWEST or FIFO_BLOCK when the output reader lags
+    unsigned out_deadline_ms;   // longest wait of FIFO_BLOCK
+    unsigned out_gap_marker;    // zero the audio at each discontinuity of the output
     unsigned filter_length;
     unsigned bypass;
+    unsigned align;         // keep capture and reference aligned with the PCM delays
+    unsigned fixed_length;  // keep filter_length instead of fitting it to the echo tail
+    unsigned single_thread; // run devices, FIFOs and processing from one epoll loop, see audio_loop()
+    unsigned pipelined;     // run the AEC and the output on threads of their own, see graph.c
+    unsigned subband;       // cancel echo on the 0-8 kHz band only, for 32 or 48 kHz
+    unsigned recorder_seconds;  // audio kept by the flight recorder, 0 to disable
+
+    // called by the capture thread when new audio is in the capture ring buffer
+    void (*capture_notify)(void *arg);
+    void *capture_notify_arg;
+
+    struct _audio_t *audio; // capture and playback state, see audio.c
+    struct _fifo_t *fifo;   // output FIFO state, see fifo.c
+    struct _prompts_t *prompts; // mixed into the playback, see prompt.c
 } conf_t;
 
 #endif // _CONF_H_
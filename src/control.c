@@ -0,0 +1,139 @@
+// control.c - commands from a named pipe
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "control.h"
+
+#define CONTROL_MAX 32
+#define CONTROL_LINE_SIZE 256
+
+typedef struct
+{
+    char name[16];
+    control_fn fn;
+    void *arg;
+} command_t;
+
+static command_t g_commands[CONTROL_MAX];
+static int g_command_count = 0;
+static int g_control_fd = -1;
+static pthread_t g_control_thread;
+
+// register before control_start(). Several handlers may share a name, e.g. one per pipeline.
+int control_register(const char *name, control_fn fn, void *arg)
+{
+    if (g_command_count >= CONTROL_MAX)
+    {
+        fprintf(stderr, "Too many control commands\n");
+        exit(1);
+    }
+
+    command_t *command = &g_commands[g_command_count++];
+    snprintf(command->name, sizeof(command->name), "%s", name);
+    command->fn = fn;
+    command->arg = arg;
+
+    return 0;
+}
+
+static void control_dispatch(char *line)
+{
+    char *args = line + strcspn(line, " \t");
+    if (*args != '\0')
+    {
+        *args++ = '\0';
+        args += strspn(args, " \t");
+    }
+
+    if (line[0] == '\0')
+    {
+        return;
+    }
+
+    int found = 0;
+    for (int i = 0; i < g_command_count; i++)
+    {
+        if (strcmp(g_commands[i].name, line) == 0)
+        {
+            g_commands[i].fn(g_commands[i].arg, args);
+            found = 1;
+        }
+    }
+
+    if (!found)
+    {
+        printf("Unknown control command: %s\n", line);
+    }
+}
+
+static void *control_thread(void *ptr)
+{
+    char line[CONTROL_LINE_SIZE];
+    int len = 0;
+
+    while (1)
+    {
+        int r = read(g_control_fd, line + len, sizeof(line) - 1 - len);
+        if (r <= 0)
+        {
+            usleep(100000);
+            continue;
+        }
+        len += r;
+        line[len] = '\0';
+
+        char *start = line;
+        char *end;
+        while ((end = strchr(start, '\n')) != NULL)
+        {
+            *end = '\0';
+            control_dispatch(start);
+            start = end + 1;
+        }
+
+        len -= start - line;
+        memmove(line, start, len);
+
+        // drop a line too long to be a command
+        if (len >= (int)sizeof(line) - 1)
+        {
+            len = 0;
+        }
+    }
+
+    return NULL;
+}
+
+int control_start(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+    {
+        mkfifo(path, 0666);
+    }
+    else if (!S_ISFIFO(st.st_mode))
+    {
+        remove(path);
+        mkfifo(path, 0666);
+    }
+
+    // opened for writing too, so read() blocks instead of returning EOF between writers
+    g_control_fd = open(path, O_RDWR);
+    if (g_control_fd < 0)
+    {
+        fprintf(stderr, "failed to open %s, error %d\n", path, g_control_fd);
+        return -1;
+    }
+
+    pthread_create(&g_control_thread, NULL, control_thread, NULL);
+    pthread_detach(g_control_thread);
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+// Text commands written to a named pipe, one per line, e.g. `echo dump > /tmp/ec.control`
+
+typedef void (*control_fn)(void *arg, char *args);
+
+int control_register(const char *name, control_fn fn, void *arg);
+int control_start(const char *path);
+
+#endif // _CONTROL_H_
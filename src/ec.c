@@ -11,10 +11,20 @@
 #include <errno.h>
 #include <sys/stat.h>
 
-#include <speex/speex_echo.h>
-
 #include "conf.h"
+#include "control.h"
+#include "arena.h"
 #include "audio.h"
+#include "calibrate.h"
+#include "fifo.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "prompt.h"
+#include "recorder.h"
+#include "soak.h"
+#include "stats.h"
+#include "trace.h"
 
 const char *usage =
     "Usage:\n %s [options]\n"
@@ -23,22 +33,47 @@ const char *usage =
     " -o PCM            capture PCM (default)\n"
     " -r rate           sample rate (16000)\n"
     " -c channels       recording channels (2)\n"
-    " -b size           buffer size (262144)\n"
-    " -d delay          system delay between playback and capture (0)\n"
+    " -p channels       playback (reference) channels (1)\n"
+    " -b frames         ring buffer size, 0 to fit each ring to its use (0)\n"
+    " -d delay          system delay between playback and capture, or auto to use the calibrated one (0)\n"
+    " -A                don't realign capture and playback with the PCM delays while running\n"
+    " -C                calibrate the delay with a test sequence and cache it\n"
     " -f filter_length  AEC filter length (2048)\n"
+    " -a budget         pick the longest filter, and full band over sub-band, that costs at most budget %%\n"
+    "                   of a core, benchmarked at startup and cached per host in /var/tmp/ec.profile\n"
+    " -F                keep the AEC filter length instead of fitting it to the echo tail\n"
+    " -S                at 32 or 48 kHz, cancel echo on the 0-8 kHz band and suppress it above\n"
+    " -t ms             AEC frame length in ms, e.g. 4, 8, 10, 16 or 20 (10)\n"
+    " -O policy         when the output reader lags, drop the oldest or newest audio or block up to ms\n"
+    "                   first: oldest, newest or block[:ms] (oldest)\n"
+    " -g                zero 10 ms of the output after each gap left by dropped audio\n"
+    " -k hours          soak test, exit after hours of audio and write a summary to /tmp/ec.soak\n"
+    " -T file           record a timeline of the threads, written to file as Chrome trace JSON on exit\n"
+    " -n frames         max AEC frames processed per wakeup to catch up (4)\n"
+    " -P                pipelined: read, cancel echo and write the output on separate threads\n"
     " -s                save audio to /tmp/playback.raw, /tmp/recording.raw and /tmp/out.raw\n"
+    " -R seconds        audio kept in memory by the flight recorder, 0 to disable (10)\n"
+    " -E                run devices, FIFOs and the AEC from one thread with an epoll loop\n"
+    " -W dir            prompts (.wav or .raw) to play on `echo play {name} > /tmp/ec.control`\n"
     " -D                daemonize\n"
     " -h                display this help text\n"
     "Note:\n"
     " Access audio I/O through named pipes (/tmp/ec.input for playback and /tmp/ec.output for recording)\n"
     "  `cat audio.raw > /tmp/ec.input` to play audio\n"
     "  `cat /tmp/ec.output > out.raw` to get recording audio\n"
-    " Only support mono playback\n";
+    " Metrics are written to /tmp/ec.stats every second\n"
+    " `echo dump > /tmp/ec.control` or SIGUSR1 dumps the flight recorder to /tmp\n"
+    " Playback audio is interleaved S16_LE with the number of channels set by -p\n";
 
 volatile int g_is_quit = 0;
 
-extern int fifo_setup(conf_t *conf);
-extern int fifo_write(void *buf, size_t frames);
+#define SOAK_FILE "/tmp/ec.soak"
+
+#define DELAY_CACHE "/var/tmp/ec.delay"    // calibrated delay per device pair
+
+#define PROFILE_CACHE "/var/tmp/ec.profile"    // settings picked per host and channel layout
+
+#define ARENA_RESERVE (64 * 1024 * 1024)    // address space only, unused pages are given back
 
 void int_handler(int signal)
 {
@@ -47,19 +82,81 @@ void int_handler(int signal)
     g_is_quit = 1;
 }
 
+void dump_handler(int signal)
+{
+    recorder_trigger();
+}
+
+static void dump_command(void *arg, char *args)
+{
+    recorder_trigger();
+}
+
+typedef struct
+{
+    pipeline_t *pipeline;
+    unsigned skip;          // startup delay frames left to skip
+    unsigned stats_frames;
+    unsigned soak_hours;
+} ec_t;
+
+// Process a batch of frames, return the number of samples per channel processed
+static int process(ec_t *ec, int timeout)
+{
+    conf_t *conf = ec->pipeline->conf;
+    int samples = pipeline_process(ec->pipeline, timeout);
+
+    ec->stats_frames += samples;
+    if (ec->stats_frames >= conf->rate)
+    {
+        ec->stats_frames -= conf->rate;
+        stats_write(conf->stats_file);
+
+        if (ec->soak_hours && soak_tick())
+        {
+            g_is_quit = 1;
+        }
+    }
+
+    return samples;
+}
+
+// Called by audio_loop() while a frame is captured, never waits
+static int loop_process(void *arg)
+{
+    ec_t *ec = (ec_t *)arg;
+
+    if (ec->skip)
+    {
+        unsigned available = capture_available(ec->pipeline->conf);
+        unsigned frames = available < ec->skip ? available : ec->skip;
+        ec->skip -= capture_skip(ec->pipeline->conf, frames);
+        if (ec->skip == 0)
+        {
+            printf("skip frames done\n");
+        }
+        return frames;
+    }
+
+    return process(ec, 0);
+}
+
 int main(int argc, char *argv[])
 {
-    SpeexEchoState *echo_state;
-    int16_t *rec = NULL;
-    int16_t *far = NULL;
-    int16_t *out = NULL;
+    pipeline_t pipeline;
     FILE *fp_rec = NULL;
     FILE *fp_far = NULL;
     FILE *fp_out = NULL;
 
     int opt = 0;
     int delay = 0;
+    int delay_auto = 0;
+    int calibrate = 0;
     int save_audio = 0;
+    char *trace_file = NULL;
+    char *prompt_dir = NULL;
+    unsigned soak_hours = 0;
+    unsigned budget = 0;
     int daemonize = 0;
 
     conf_t config = {
@@ -67,21 +164,33 @@ int main(int argc, char *argv[])
         .out_pcm = "default",
         .playback_fifo = "/tmp/ec.input",
         .out_fifo = "/tmp/ec.output",
+        .stats_file = "/tmp/ec.stats",
+        .control_fifo = "/tmp/ec.control",
         .rate = 16000,
         .rec_channels = 2,
         .ref_channels = 1,
         .out_channels = 2,
         .bits_per_sample = 16,
-        .buffer_size = 1024 * 16,
+        .frame_ms = 10,
+        .max_batch = 4,
+        .buffer_size = 0,
         .playback_fifo_size = 1024 * 4,
         .filter_length = 4096,
-        .bypass = 1
+        .bypass = 1,
+        .align = 1,
+        .recorder_seconds = 10
     };
 
-    while ((opt = getopt(argc, argv, "b:c:d:Df:hi:o:r:s")) != -1)
+    while ((opt = getopt(argc, argv, "a:Ab:c:Cd:DEf:Fghi:k:n:o:O:p:Pr:R:sSt:T:W:")) != -1)
     {
         switch (opt)
         {
+        case 'a':
+            budget = atoi(optarg);
+            break;
+        case 'A':
+            config.align = 0;
+            break;
         case 'b':
             config.buffer_size = atoi(optarg);
             break;
@@ -89,30 +198,87 @@ int main(int argc, char *argv[])
             config.rec_channels = atoi(optarg);
             config.out_channels = config.rec_channels;
             break;
+        case 'C':
+            calibrate = 1;
+            break;
         case 'd':
+            delay_auto = strcmp(optarg, "auto") == 0;
             delay = atoi(optarg);
             break;
         case 'D':
             daemonize = 1;
             break;
+        case 'E':
+            config.single_thread = 1;
+            break;
         case 'f':
             config.filter_length = atoi(optarg);
             break;
+        case 'F':
+            config.fixed_length = 1;
+            break;
+        case 'g':
+            config.out_gap_marker = 1;
+            break;
         case 'h':
             printf(usage, argv[0]);
             exit(0);
+        case 'k':
+            soak_hours = atoi(optarg);
+            break;
         case 'i':
             config.rec_pcm = optarg;
             break;
+        case 'n':
+            config.max_batch = atoi(optarg);
+            break;
         case 'o':
             config.out_pcm = optarg;
             break;
+        case 'O':
+            if (fifo_parse_policy(&config, optarg) < 0)
+            {
+                printf("Unknown output policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+        {
+            char *end;
+            long channels = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || channels < 1 || channels > MAX_CHANNELS)
+            {
+                printf("Playback channels must be 1 to %d\n\n", MAX_CHANNELS);
+                printf(usage, argv[0]);
+                exit(1);
+            }
+            config.ref_channels = channels;
+            break;
+        }
+        case 'P':
+            config.pipelined = 1;
+            break;
         case 'r':
             config.rate = atoi(optarg);
             break;
+        case 'R':
+            config.recorder_seconds = atoi(optarg);
+            break;
         case 's':
             save_audio = 1;
             break;
+        case 'S':
+            config.subband = 1;
+            break;
+        case 't':
+            config.frame_ms = atoi(optarg);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'W':
+            prompt_dir = optarg;
+            break;
         case '?':
             printf("\n");
             printf(usage, argv[0]);
@@ -122,6 +288,24 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (config.single_thread && config.pipelined)
+    {
+        printf("-E and -P can't be used together\n");
+        exit(1);
+    }
+
+    if (config.single_thread && calibrate)
+    {
+        printf("Calibration needs the threaded mode, run once without -E\n");
+        exit(1);
+    }
+
+    if (config.single_thread && config.out_policy == FIFO_BLOCK)
+    {
+        // the reader can't make room while the only thread waits for it
+        config.out_policy = FIFO_DROP_NEWEST;
+    }
+
     if (daemonize)
     {
         pid_t pid, sid;
@@ -161,8 +345,6 @@ int main(int argc, char *argv[])
         }
     }
 
-    int frame_size = config.rate * 10 / 1000; // 10 ms
-
     if (save_audio)
     {
         fp_far = fopen("/tmp/playback.raw", "wb");
@@ -176,14 +358,19 @@ int main(int argc, char *argv[])
         }
     }
 
-    rec = (int16_t *)calloc(frame_size * config.rec_channels, sizeof(int16_t));
-    far = (int16_t *)calloc(frame_size * config.ref_channels, sizeof(int16_t));
-    out = (int16_t *)calloc(frame_size * config.out_channels, sizeof(int16_t));
+    kernels_init();
 
-    if (rec == NULL || far == NULL || out == NULL)
+    // before the arena, the benchmark allocates and frees echo states
+    if (budget)
     {
-        printf("Fail to allocate memory\n");
-        exit(1);
+        profile_select(&config, budget, PROFILE_CACHE);
+    }
+
+    arena_init(ARENA_RESERVE + (trace_file ? trace_size(config.frame_ms) : 0));
+
+    if (trace_file)
+    {
+        trace_init(trace_file, config.frame_ms);
     }
 
     // Configures signal handling.
@@ -193,47 +380,110 @@ int main(int argc, char *argv[])
     sig_int_handler.sa_flags = 0;
     sigaction(SIGINT, &sig_int_handler, NULL);
 
-    echo_state = speex_echo_state_init_mc(frame_size,
-                                          config.filter_length,
-                                          config.rec_channels,
-                                          config.ref_channels);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &(config.rate));
+    // a reader leaving the output FIFO is seen as EPIPE, and processing idles until the next one
+    signal(SIGPIPE, SIG_IGN);
+
+    pipeline_init(&pipeline, &config, NULL, NULL);
+    pipeline.fp_rec = fp_rec;
+    pipeline.fp_far = fp_far;
+    pipeline.fp_out = fp_out;
+
+    // mixed into the playback from its first transfer on
+    if (prompt_dir)
+    {
+        prompt_load(&config, prompt_dir);
+    }
+
+    if (delay_auto && !calibrate)
+    {
+        delay = calibrate_load(&config, DELAY_CACHE);
+        if (delay < 0)
+        {
+            printf("No calibrated delay for %s -> %s, calibrating\n", config.out_pcm, config.rec_pcm);
+            if (config.single_thread)
+            {
+                printf("Calibration needs the threaded mode, run once without -E\n");
+                exit(1);
+            }
+            calibrate = 1;
+            delay = 0;
+        }
+    }
+
+    // the playback ring holds the reference for the delay, or for any delay calibration may find
+    config.delay = calibrate ? config.rate * CALIBRATE_MAX_DELAY_MS / 1000 : delay;
 
     playback_start(&config);
     capture_start(&config);
     fifo_setup(&config);
 
-    printf("Running... Press Ctrl+C to exit\n");
-
-    int timeout = 200 * 1000 * frame_size / config.rate;    // ms
+    if (config.recorder_seconds)
+    {
+        struct sigaction sig_dump_handler;
+        sig_dump_handler.sa_handler = dump_handler;
+        sigemptyset(&sig_dump_handler.sa_mask);
+        sig_dump_handler.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sig_dump_handler, NULL);
+
+        recorder_start();
+        control_register("dump", dump_command, NULL);
+    }
+    control_start(config.control_fifo);
 
-    // system delay between recording and playback
-    printf("skip frames %d\n", capture_skip(delay));
+    if (calibrate)
+    {
+        calibrate_init(&config);
+    }
 
-    while (!g_is_quit)
+    if (soak_hours)
     {
-        capture_read(rec, frame_size, timeout);
-        playback_read(far, frame_size, timeout);
+        soak_init(&config, soak_hours);
+    }
 
-        if (!config.bypass)
-        {
-            speex_echo_cancellation(echo_state, rec, far, out);
-        }
-        else
+    // nothing is allocated from here on
+    arena_seal();
+
+    trace_thread("main");
+
+    printf("Running... Press Ctrl+C to exit\n");
+
+    int timeout = 200 * 1000 * pipeline.frame_size / config.rate;    // ms
+
+    if (calibrate)
+    {
+        int measured = calibrate_run(&config);
+        if (measured >= 0)
         {
-            memcpy(out, rec, frame_size * config.rec_channels * config.bits_per_sample / 8);
+            delay = measured;
+            calibrate_save(&config, DELAY_CACHE, delay);
         }
+    }
 
-        if (fp_far)
+    ec_t ec = {
+        .pipeline = &pipeline,
+        .soak_hours = soak_hours
+    };
+
+    if (config.single_thread)
+    {
+        // system delay between recording and playback, skipped as it arrives
+        printf("skip frames %d\n", delay);
+        ec.skip = delay;
+        audio_loop(&config, loop_process, &ec);
+    }
+    else
+    {
+        // system delay between recording and playback
+        printf("skip frames %d\n", capture_skip(&config, delay));
+
+        while (!g_is_quit)
         {
-            fwrite(rec, 2, frame_size * config.rec_channels, fp_rec);
-            fwrite(far, 2, frame_size, fp_far);
-            fwrite(out, 2, frame_size * config.out_channels, fp_out);
+            process(&ec, timeout);
         }
-
-        fifo_write(out, frame_size);
     }
 
+    pipeline_stop(&pipeline);
+
     if (fp_far)
     {
         fclose(fp_rec);
@@ -241,12 +491,17 @@ int main(int argc, char *argv[])
         fclose(fp_out);
     }
 
-    free(rec);
-    free(far);
-    free(out);
+    capture_stop(&config);
+    playback_stop(&config);
+
+    if (soak_hours)
+    {
+        soak_report(SOAK_FILE);
+    }
+
+    trace_write();
 
-    capture_stop();
-    playback_stop();
+    arena_destroy();
 
     exit(0);
 
@@ -0,0 +1,164 @@
+// ec_bench - measure AEC cost for different channel layouts
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <speex/speex_echo.h>
+
+#include "pipeline.h"
+#include "util.h"
+
+const char *usage =
+    "Usage:\n %s [options]\n"
+    "Options:\n"
+    " -r rate           sample rate (16000)\n"
+    " -c channels       recording channels (2)\n"
+    " -p channels       max playback (reference) channels to test (2)\n"
+    " -f filter_length  AEC filter length (4096)\n"
+    " -t ms             AEC frame length in ms (10)\n"
+    " -n frames         frames to process per layout (1000)\n"
+    " -h                display this help text\n"
+    "Note:\n"
+    " Runs speex_echo_cancellation on synthetic audio with 1 to N reference channels\n"
+    " and reports the cost per frame and the extra cost per reference channel\n";
+
+static void fill_noise(int16_t *buf, size_t samples, unsigned *seed)
+{
+    for (size_t i = 0; i < samples; i++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        buf[i] = (int16_t)((*seed >> 16) & 0x1FFF) - 0x1000;
+    }
+}
+
+// return average microseconds per frame
+static double bench(unsigned rate, unsigned frame_ms, unsigned rec_channels, unsigned ref_channels,
+                    unsigned filter_length, unsigned frames)
+{
+    int frame_size = rate * frame_ms / 1000;
+    unsigned seed = 1;
+
+    int16_t *rec = (int16_t *)calloc(frame_size * rec_channels, sizeof(int16_t));
+    int16_t *far = (int16_t *)calloc(frame_size * ref_channels, sizeof(int16_t));
+    int16_t *out = (int16_t *)calloc(frame_size * rec_channels, sizeof(int16_t));
+
+    if (rec == NULL || far == NULL || out == NULL)
+    {
+        printf("Fail to allocate memory\n");
+        exit(1);
+    }
+
+    SpeexEchoState *echo_state = speex_echo_state_init_mc(frame_size,
+                                                          filter_length,
+                                                          rec_channels,
+                                                          ref_channels);
+    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+
+    // warm up
+    for (int i = 0; i < 10; i++)
+    {
+        fill_noise(rec, frame_size * rec_channels, &seed);
+        fill_noise(far, frame_size * ref_channels, &seed);
+        speex_echo_cancellation(echo_state, rec, far, out);
+    }
+
+    double elapsed = 0;
+    for (unsigned i = 0; i < frames; i++)
+    {
+        fill_noise(rec, frame_size * rec_channels, &seed);
+        fill_noise(far, frame_size * ref_channels, &seed);
+
+        double start = now_us();
+        speex_echo_cancellation(echo_state, rec, far, out);
+        elapsed += now_us() - start;
+    }
+
+    speex_echo_state_destroy(echo_state);
+    free(rec);
+    free(far);
+    free(out);
+
+    return elapsed / frames;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    unsigned rate = 16000;
+    unsigned rec_channels = 2;
+    unsigned max_ref_channels = 2;
+    unsigned filter_length = 4096;
+    unsigned frames = 1000;
+    unsigned frame_ms = 10;
+
+    while ((opt = getopt(argc, argv, "c:f:hn:p:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            rec_channels = atoi(optarg);
+            break;
+        case 'f':
+            filter_length = atoi(optarg);
+            break;
+        case 'h':
+            printf(usage, argv[0]);
+            exit(0);
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'p':
+        {
+            char *end;
+            long channels = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || channels < 1 || channels > MAX_CHANNELS)
+            {
+                printf("Playback channels must be 1 to %d\n\n", MAX_CHANNELS);
+                printf(usage, argv[0]);
+                exit(1);
+            }
+            max_ref_channels = channels;
+            break;
+        }
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 't':
+            frame_ms = atoi(optarg);
+            break;
+        case '?':
+            printf("\n");
+            printf(usage, argv[0]);
+            exit(1);
+        default:
+            break;
+        }
+    }
+
+    if (rec_channels < 1 || max_ref_channels < 1 || frames < 1 || frame_ms < 1)
+    {
+        printf("Channels, frames and frame length must be at least 1\n");
+        exit(1);
+    }
+
+    double frame_us = frame_ms * 1000.0;
+    double base = 0;
+
+    printf("rate %u, frame %u ms, recording channels %u, filter length %u, %u frames\n",
+           rate, frame_ms, rec_channels, filter_length, frames);
+    printf("ref_channels  us/frame  cpu%%   extra us/frame\n");
+    for (unsigned ref = 1; ref <= max_ref_channels; ref++)
+    {
+        double cost = bench(rate, frame_ms, rec_channels, ref, filter_length, frames);
+        if (ref == 1)
+        {
+            base = cost;
+        }
+        printf("%12u  %8.1f  %5.1f  %+14.1f\n", ref, cost, 100 * cost / frame_us, cost - base);
+    }
+
+    return 0;
+}
@@ -11,35 +11,61 @@
 #include <errno.h>
 #include <sys/stat.h>
 
-#include <speex/speex_echo.h>
-
 #include "conf.h"
+#include "control.h"
+#include "arena.h"
 #include "audio.h"
+#include "fifo.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "recorder.h"
+#include "soak.h"
+#include "stats.h"
+#include "trace.h"
 
 const char *usage =
-    "Usage:\n %s -c {input channels} -l {loopback channel} -m {mic channel list} [options]\n"
+    "Usage:\n %s -c {input channels} -l {loopback channel list} -m {mic channel list} [options]\n"
     "Options:\n"
     " -i PCM            playback PCM (default)\n"
     // " -o PCM            capture PCM (default)\n"
     " -r rate           sample rate (16000)\n"
     " -c channels       input channels\n"
-    " -b size           buffer size (262144)\n"
+    " -b frames         ring buffer size, 0 to fit each ring to its use (0)\n"
     // " -d delay          system delay between playback and capture (0)\n"
     " -f filter_length  AEC filter length (2048)\n"
-    " -l loopback       loopback channel\n"
+    " -a budget         pick the longest filter, and full band over sub-band, that costs at most budget %%\n"
+    "                   of a core, benchmarked at startup and cached per host in /var/tmp/ec.profile\n"
+    " -F                keep the AEC filter length instead of fitting it to the echo tail\n"
+    " -S                at 32 or 48 kHz, cancel echo on the 0-8 kHz band and suppress it above\n"
+    " -l loopback       loopback channel list\n"
     " -m mic_channels   microphone channel list\n"
+    " -t ms             AEC frame length in ms, e.g. 4, 8, 10, 16 or 20 (10)\n"
+    " -O policy         when the output reader lags, drop the oldest or newest audio or block up to ms\n"
+    "                   first: oldest, newest or block[:ms] (oldest)\n"
+    " -g                zero 10 ms of the output after each gap left by dropped audio\n"
+    " -k hours          soak test, exit after hours of audio and write a summary to /tmp/ec.soak\n"
+    " -T file           record a timeline of the threads, written to file as Chrome trace JSON on exit\n"
+    " -n frames         max AEC frames processed per wakeup to catch up (4)\n"
+    " -P                pipelined: read, cancel echo and write the output on separate threads\n"
     " -s                save audio to /tmp/recording.raw and /tmp/out.raw\n"
+    " -R seconds        audio kept in memory by the flight recorder, 0 to disable (10)\n"
     " -D                daemonize\n"
     " -h                display this help text\n"
     "Note:\n"
     " Echo Cancellation with loopback channel\n"
     "  `cat /tmp/ec.output > out.raw` to get recording audio\n"
-    " Only support mono playback\n";
+    " Metrics are written to /tmp/ec.stats every second\n"
+    " `echo dump > /tmp/ec.control` or SIGUSR1 dumps the flight recorder to /tmp\n"
+    " Use a list such as `-l 6,7` for stereo or multichannel loopback\n";
 
 volatile int g_is_quit = 0;
 
-extern int fifo_setup(conf_t *conf);
-extern int fifo_write(void *buf, size_t frames);
+#define SOAK_FILE "/tmp/ec.soak"
+
+#define PROFILE_CACHE "/var/tmp/ec.profile"    // settings picked per host and channel layout
+
+#define ARENA_RESERVE (64 * 1024 * 1024)    // address space only, unused pages are given back
 
 void int_handler(int signal)
 {
@@ -48,6 +74,16 @@ void int_handler(int signal)
     g_is_quit = 1;
 }
 
+void dump_handler(int signal)
+{
+    recorder_trigger();
+}
+
+static void dump_command(void *arg, char *args)
+{
+    recorder_trigger();
+}
+
 void daemonize(void)
 {
     pid_t pid, sid;
@@ -90,42 +126,50 @@ void daemonize(void)
 
 int main(int argc, char *argv[])
 {
-    SpeexEchoState *echo_state;
-    int16_t *rec = NULL;
-    int16_t *near = NULL;
-    int16_t *far = NULL;
-    int16_t *out = NULL;
+    pipeline_t pipeline;
     FILE *fp_rec = NULL;
     FILE *fp_out = NULL;
 
     int opt = 0;
     // int delay = 0;
     int save_audio = 0;
+    char *trace_file = NULL;
+    unsigned soak_hours = 0;
+    unsigned budget = 0;
     int daemon = 0;
     char *mic_list_str = NULL;
-    int mic_list[32];
-    int loopback_channel = -1;
+    char *loopback_list_str = NULL;
+    int mic_list[MAX_CHANNELS];
+    int loopback_list[MAX_CHANNELS];
 
     conf_t config = {
         .rec_pcm = "default",
         .out_pcm = "default",
         .playback_fifo = "/tmp/ec.input",
         .out_fifo = "/tmp/ec.output",
+        .stats_file = "/tmp/ec.stats",
+        .control_fifo = "/tmp/ec.control",
         .rate = 16000,
         .rec_channels = 0,
         .ref_channels = 1,
         .out_channels = 0,
         .bits_per_sample = 16,
-        .buffer_size = 1024 * 16,
+        .frame_ms = 10,
+        .max_batch = 4,
+        .buffer_size = 0,
         .playback_fifo_size = 1024 * 4,
         .filter_length = 4096,
-        .bypass = 0
+        .bypass = 0,
+        .recorder_seconds = 10
     };
 
-    while ((opt = getopt(argc, argv, "b:c:d:Df:hi:l:m:o:r:s")) != -1)
+    while ((opt = getopt(argc, argv, "a:b:c:d:Df:Fghi:k:l:m:n:o:O:Pr:R:sSt:T:")) != -1)
     {
         switch (opt)
         {
+        case 'a':
+            budget = atoi(optarg);
+            break;
         case 'b':
             config.buffer_size = atoi(optarg);
             break;
@@ -141,29 +185,63 @@ int main(int argc, char *argv[])
         case 'f':
             config.filter_length = atoi(optarg);
             break;
+        case 'F':
+            config.fixed_length = 1;
+            break;
+        case 'g':
+            config.out_gap_marker = 1;
+            break;
         case 'h':
             printf(usage, argv[0]);
             exit(0);
+        case 'k':
+            soak_hours = atoi(optarg);
+            break;
         case 'i':
             config.rec_pcm = optarg;
             break;
         case 'l':
-            loopback_channel = atoi(optarg);
-            // loopback channel
+            // loopback channel list
+            loopback_list_str = optarg;
             break;
         case 'm':
             // microphone channel list
             mic_list_str = optarg;
             break;
+        case 'n':
+            config.max_batch = atoi(optarg);
+            break;
         // case 'o':
         //     config.out_pcm = optarg;
         //     break;
+        case 'O':
+            if (fifo_parse_policy(&config, optarg) < 0)
+            {
+                printf("Unknown output policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'P':
+            config.pipelined = 1;
+            break;
         case 'r':
             config.rate = atoi(optarg);
             break;
+        case 'R':
+            config.recorder_seconds = atoi(optarg);
+            break;
         case 's':
             save_audio = 1;
             break;
+        case 'S':
+            config.subband = 1;
+            break;
+        case 't':
+            config.frame_ms = atoi(optarg);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
         case '?':
             printf("\n");
             printf(usage, argv[0]);
@@ -178,11 +256,31 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    if (loopback_channel < 0 || loopback_channel >= config.rec_channels) {
-        printf("The loopback channel %d is not valid\n", loopback_channel);
+    if (loopback_list_str == NULL) {
+        printf("Loopback channel is not set, use '-l' to set one\n");
         exit(-1);
     }
 
+    char *loopback_channel_str = strtok(loopback_list_str, ",");
+    config.ref_channels = 0;
+    while (loopback_channel_str != NULL) {
+        int channel = atoi(loopback_channel_str);
+        if (channel < 0 || channel >= config.rec_channels) {
+            printf("The loopback channel %d is not valid\n", channel);
+            exit(-1);
+        }
+
+        loopback_list[config.ref_channels] = channel;
+        config.ref_channels++;
+
+        if (config.ref_channels >= config.rec_channels) {
+            printf("The loopback channels %d must be less than input channels %d\n", config.ref_channels, config.rec_channels);
+            exit(-1);
+        }
+
+        loopback_channel_str = strtok(NULL, ",");
+    }
+
     char *mic_channel_str = strtok(mic_list_str, ",");
     config.out_channels = 0;
     while (mic_channel_str != NULL) {
@@ -208,8 +306,6 @@ int main(int argc, char *argv[])
     }
     
 
-    int frame_size = config.rate * 10 / 1000; // 10 ms
-
     if (save_audio)
     {
         fp_rec = fopen("/tmp/recording.raw", "wb");
@@ -222,15 +318,19 @@ int main(int argc, char *argv[])
         }
     }
 
-    rec = (int16_t *)calloc(frame_size * config.rec_channels, sizeof(int16_t));
-    near = (int16_t *)calloc(frame_size * config.out_channels, sizeof(int16_t));
-    far = (int16_t *)calloc(frame_size * config.ref_channels, sizeof(int16_t));
-    out = (int16_t *)calloc(frame_size * config.out_channels, sizeof(int16_t));
+    kernels_init();
 
-    if (rec == NULL || near == NULL || far == NULL || out == NULL)
+    // before the arena, the benchmark allocates and frees echo states
+    if (budget)
     {
-        printf("Fail to allocate memory\n");
-        exit(1);
+        profile_select(&config, budget, PROFILE_CACHE);
+    }
+
+    arena_init(ARENA_RESERVE + (trace_file ? trace_size(config.frame_ms) : 0));
+
+    if (trace_file)
+    {
+        trace_init(trace_file, config.frame_ms);
     }
 
     // Configures signal handling.
@@ -240,56 +340,79 @@ int main(int argc, char *argv[])
     sig_int_handler.sa_flags = 0;
     sigaction(SIGINT, &sig_int_handler, NULL);
 
-    echo_state = speex_echo_state_init_mc(frame_size,
-                                          config.filter_length,
-                                          config.out_channels,
-                                          config.ref_channels);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &(config.rate));
+    // a reader leaving the output FIFO is seen as EPIPE, and processing idles until the next one
+    signal(SIGPIPE, SIG_IGN);
+
+    pipeline_init(&pipeline, &config, mic_list, loopback_list);
+    pipeline.fp_rec = fp_rec;
+    pipeline.fp_out = fp_out;
+
+    unsigned stats_frames = 0;
 
     capture_start(&config);
     fifo_setup(&config);
 
+    if (config.recorder_seconds)
+    {
+        struct sigaction sig_dump_handler;
+        sig_dump_handler.sa_handler = dump_handler;
+        sigemptyset(&sig_dump_handler.sa_mask);
+        sig_dump_handler.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sig_dump_handler, NULL);
+
+        recorder_start();
+        control_register("dump", dump_command, NULL);
+    }
+    control_start(config.control_fifo);
+
+    if (soak_hours)
+    {
+        soak_init(&config, soak_hours);
+    }
+
+    // nothing is allocated from here on
+    arena_seal();
+
+    trace_thread("main");
+
     printf("Running... Press Ctrl+C to exit\n");
 
-    int timeout = 200 * 1000 * frame_size / config.rate;    // ms
+    int timeout = 200 * 1000 * pipeline.frame_size / config.rate;    // ms
 
 
     while (!g_is_quit)
     {
-        capture_read(rec, frame_size, timeout);
+        int samples = pipeline_process(&pipeline, timeout);
 
-        for (int i=0; i<frame_size; i++) {
-            for (int mic=0; mic<config.out_channels; mic++) {
-                int channel = mic_list[mic];
-                near[config.out_channels * i + channel] = rec[config.rec_channels * i + channel];
-            }
+        stats_frames += samples;
+        if (stats_frames >= config.rate) {
+            stats_frames -= config.rate;
+            stats_write(config.stats_file);
 
-            far[i] = rec[config.rec_channels * i + loopback_channel];
-        }
-
-        speex_echo_cancellation(echo_state, near, far, out);
-
-        if (fp_rec)
-        {
-            fwrite(rec, 2, frame_size * config.rec_channels, fp_rec);
-            fwrite(out, 2, frame_size * config.out_channels, fp_out);
+            if (soak_hours && soak_tick()) {
+                g_is_quit = 1;
+            }
         }
-
-        fifo_write(out, frame_size);
     }
 
+    pipeline_stop(&pipeline);
+
     if (fp_rec)
     {
         fclose(fp_rec);
         fclose(fp_out);
     }
 
-    free(rec);
-    free(near);
-    free(far);
-    free(out);
+    capture_stop(&config);
+
+    if (soak_hours)
+    {
+        soak_report(SOAK_FILE);
+    }
+
+    trace_write();
 
-    capture_stop();
+    arena_destroy();
 
     exit(0);
 
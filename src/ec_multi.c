@@ -0,0 +1,555 @@
+// ec_multi - echo canceller for several mic arrays
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "conf.h"
+#include "control.h"
+#include "arena.h"
+#include "audio.h"
+#include "fifo.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "recorder.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+
+const char *usage =
+    "Usage:\n %s -a {array} [-a {array} ...] [options]\n"
+    "Options:\n"
+    " -a array          add a mic array, a comma separated list of key=value:\n"
+    "                     name=NAME     name, prefixes its metrics (a0, a1, ...)\n"
+    "                     i=PCM         capture PCM (default)\n"
+    "                     o=PCM         playback PCM (default)\n"
+    "                     c=N           recording channels (2)\n"
+    "                     p=N           playback (reference) channels (1)\n"
+    "                     l=A:B         loopback channel list, the reference is recorded\n"
+    "                     m=A:B         microphone channel list, with loopback\n"
+    "                     d=N           system delay between playback and capture (0)\n"
+    "                     f=N           AEC filter length (4096)\n"
+    "                     in=FIFO       playback FIFO (/tmp/NAME.input)\n"
+    "                     out=FIFO      output FIFO (/tmp/NAME.output)\n"
+    " -r rate           sample rate (16000)\n"
+    " -F                keep the AEC filter length instead of fitting it to the echo tail\n"
+    " -S                at 32 or 48 kHz, cancel echo on the 0-8 kHz band and suppress it above\n"
+    " -b frames         ring buffer size, 0 to fit each ring to its use (0)\n"
+    " -M                run capture, playback and output FIFO threads per array instead of one\n"
+    "                   event loop for the devices and FIFOs of all arrays\n"
+    " -t ms             AEC frame length in ms, e.g. 4, 8, 10, 16 or 20 (10)\n"
+    " -O policy         when the output reader lags, drop the oldest or newest audio or block up to ms\n"
+    "                   first: oldest, newest or block[:ms] (oldest)\n"
+    " -g                zero 10 ms of the output after each gap left by dropped audio\n"
+    " -T file           record a timeline of the threads, written to file as Chrome trace JSON on exit\n"
+    " -n frames         max AEC frames processed per wakeup to catch up (4)\n"
+    " -w workers        worker threads (number of CPUs, at most one per array)\n"
+    " -R seconds        audio kept in memory by the flight recorder, 0 to disable (10)\n"
+    " -D                daemonize\n"
+    " -h                display this help text\n"
+    "Note:\n"
+    " Each array is processed by its own pipeline, all pipelines share one worker pool\n"
+    " The devices and FIFOs of all arrays run on one event loop thread, so only the pool grows with arrays\n"
+    "  `ec_multi -a name=front,i=hw:1,c=8,l=6:7,m=0:1:2:3 -a name=back,i=hw:2,c=2`\n"
+    " Metrics of all arrays are written to /tmp/ec.stats every second\n"
+    " `echo dump > /tmp/ec.control` or SIGUSR1 dumps the flight recorders to /tmp\n";
+
+volatile int g_is_quit = 0;
+
+#define ARENA_RESERVE (256 * 1024 * 1024)   // address space only, unused pages are given back
+
+#define MAX_ARRAYS 16
+
+typedef struct
+{
+    conf_t conf;
+    pipeline_t *pipeline;
+    pool_t *pool;
+    int index;
+    int delay;
+    char *loopback_list_str;
+    char *mic_list_str;
+    char name[16];
+    char playback_fifo[64];
+    char out_fifo[64];
+} array_t;
+
+static array_t g_arrays[MAX_ARRAYS];
+static conf_t *g_confs[MAX_ARRAYS];     // of the arrays run by the event loop
+static int g_count;
+
+void int_handler(int signal)
+{
+    printf("Caught signal %d, quit...\n", signal);
+
+    g_is_quit = 1;
+}
+
+void dump_handler(int signal)
+{
+    recorder_trigger();
+}
+
+static void dump_command(void *arg, char *args)
+{
+    recorder_trigger();
+}
+
+void daemonize(void)
+{
+    pid_t pid, sid;
+
+    /* Fork off the parent process */
+    pid = fork();
+    if (pid < 0)
+    {
+        printf("fork() failed\n");
+        exit(1);
+    }
+    /* If we got a good PID, then
+        we can exit the parent process. */
+    if (pid > 0)
+    {
+        exit(0);
+    }
+
+    /* Change the file mode mask */
+    umask(0);
+
+    /* Create a new SID for the child process */
+    sid = setsid();
+    if (sid < 0)
+    {
+        printf("setsid() failed\n");
+        exit(1);
+    }
+
+    /* Change the current working directory */
+    if ((chdir("/")) < 0)
+    {
+        printf("chdir() failed\n");
+        exit(1);
+    }
+}
+
+// parse a channel list such as "6:7", return the number of channels
+static int parse_list(const char *name, char *str, int *list, unsigned channels)
+{
+    int count = 0;
+
+    for (char *s = strtok(str, ":"); s != NULL; s = strtok(NULL, ":"))
+    {
+        int channel = atoi(s);
+        if (channel < 0 || channel >= channels)
+        {
+            printf("%s: the channel %d must be less than input channels %u\n", name, channel, channels);
+            exit(1);
+        }
+        if (count >= MAX_CHANNELS - 1 || count >= channels - 1)
+        {
+            printf("%s: too many channels in the list\n", name);
+            exit(1);
+        }
+        list[count++] = channel;
+    }
+
+    return count;
+}
+
+// parse a channel count of 1 to MAX_CHANNELS
+static unsigned parse_channels(const char *name, const char *key, const char *value)
+{
+    char *end;
+    long channels = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || channels < 1 || channels > MAX_CHANNELS)
+    {
+        printf("%s: %s= must be 1 to %d channels\n", name, key, MAX_CHANNELS);
+        exit(1);
+    }
+
+    return channels;
+}
+
+static void parse_array(array_t *array, char *spec)
+{
+    enum { NAME, REC_PCM, OUT_PCM, CHANNELS, REF_CHANNELS, LOOPBACK, MIC, DELAY, FILTER, IN_FIFO, OUT_FIFO };
+    char *const keys[] = { "name", "i", "o", "c", "p", "l", "m", "d", "f", "in", "out", NULL };
+    char *value;
+
+    while (*spec != '\0')
+    {
+        int key = getsubopt(&spec, keys, &value);
+        if (key >= 0 && key != NAME && value == NULL)
+        {
+            printf("%s needs a value\n", keys[key]);
+            exit(1);
+        }
+
+        switch (key)
+        {
+        case NAME:
+            snprintf(array->name, sizeof(array->name), "%s", value ? value : "");
+            break;
+        case REC_PCM:
+            array->conf.rec_pcm = value;
+            break;
+        case OUT_PCM:
+            array->conf.out_pcm = value;
+            break;
+        case CHANNELS:
+            array->conf.rec_channels = parse_channels(array->name, keys[key], value);
+            break;
+        case REF_CHANNELS:
+            array->conf.ref_channels = parse_channels(array->name, keys[key], value);
+            break;
+        case LOOPBACK:
+            array->loopback_list_str = value;
+            break;
+        case MIC:
+            array->mic_list_str = value;
+            break;
+        case DELAY:
+            array->delay = atoi(value);
+            break;
+        case FILTER:
+            array->conf.filter_length = atoi(value);
+            break;
+        case IN_FIFO:
+            snprintf(array->playback_fifo, sizeof(array->playback_fifo), "%s", value);
+            break;
+        case OUT_FIFO:
+            snprintf(array->out_fifo, sizeof(array->out_fifo), "%s", value);
+            break;
+        default:
+            printf("Unknown array option: %s\n", value);
+            exit(1);
+        }
+    }
+}
+
+// process the backlog of one array on a worker thread
+static void process_task(void *arg)
+{
+    array_t *array = (array_t *)arg;
+    pipeline_t *p = array->pipeline;
+
+    while (1)
+    {
+        while (pipeline_process(p, 0) > 0)
+        {
+        }
+
+        // audio may have arrived after the last read, before the flag is cleared
+        __atomic_store_n(&p->scheduled, 0, __ATOMIC_RELEASE);
+        if (capture_available(&array->conf) < p->frame_size ||
+            __atomic_exchange_n(&p->scheduled, 1, __ATOMIC_ACQ_REL))
+        {
+            break;
+        }
+    }
+}
+
+// called by the capture thread of an array, or the event loop, queue it at most once
+static void capture_notify(void *arg)
+{
+    array_t *array = (array_t *)arg;
+    pipeline_t *p = array->pipeline;
+
+    if (g_is_quit || capture_available(&array->conf) < p->frame_size)
+    {
+        return;
+    }
+
+    if (!__atomic_exchange_n(&p->scheduled, 1, __ATOMIC_ACQ_REL))
+    {
+        pool_submit(array->pool, array->index, process_task, array);
+    }
+}
+
+// the devices and FIFOs of all arrays, unless -M, the AEC stays on the worker pool
+static void *loop_thread(void *arg)
+{
+    audio_loop_arrays(g_confs, g_count, NULL, NULL);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt = 0;
+    int daemon = 0;
+    int workers = 0;
+    char *trace_file = NULL;
+    int count = 0;
+    pthread_t loop;
+
+    conf_t defaults = {
+        .rec_pcm = "default",
+        .out_pcm = "default",
+        .stats_file = "/tmp/ec.stats",
+        .control_fifo = "/tmp/ec.control",
+        .rate = 16000,
+        .rec_channels = 2,
+        .ref_channels = 1,
+        .out_channels = 2,
+        .bits_per_sample = 16,
+        .frame_ms = 10,
+        .max_batch = 4,
+        .buffer_size = 0,
+        .playback_fifo_size = 1024 * 4,
+        .filter_length = 4096,
+        .bypass = 1,
+        .align = 1,
+        .recorder_seconds = 10,
+        .single_thread = 1
+    };
+
+    // array options are parsed after the global ones they default to
+    char *specs[MAX_ARRAYS];
+
+    while ((opt = getopt(argc, argv, "a:b:DFghMn:O:r:R:St:T:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            if (count >= MAX_ARRAYS)
+            {
+                printf("At most %d arrays are supported\n", MAX_ARRAYS);
+                exit(1);
+            }
+            specs[count++] = optarg;
+            break;
+        case 'b':
+            defaults.buffer_size = atoi(optarg);
+            break;
+        case 'D':
+            daemon = 1;
+            break;
+        case 'M':
+            defaults.single_thread = 0;
+            break;
+        case 'F':
+            defaults.fixed_length = 1;
+            break;
+        case 'g':
+            defaults.out_gap_marker = 1;
+            break;
+        case 'h':
+            printf(usage, argv[0]);
+            exit(0);
+        case 'n':
+            defaults.max_batch = atoi(optarg);
+            break;
+        case 'O':
+            if (fifo_parse_policy(&defaults, optarg) < 0)
+            {
+                printf("Unknown output policy %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            defaults.rate = atoi(optarg);
+            break;
+        case 'R':
+            defaults.recorder_seconds = atoi(optarg);
+            break;
+        case 'S':
+            defaults.subband = 1;
+            break;
+        case 't':
+            defaults.frame_ms = atoi(optarg);
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case '?':
+            printf("\n");
+            printf(usage, argv[0]);
+            exit(1);
+        default:
+            break;
+        }
+    }
+
+    if (count == 0)
+    {
+        printf("No mic array is set, use '-a' to add one\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        array_t *array = &g_arrays[i];
+
+        array->conf = defaults;
+        array->index = i;
+        snprintf(array->name, sizeof(array->name), "a%d", i);
+        parse_array(array, specs[i]);
+
+        conf_t *conf = &array->conf;
+        conf->name = array->name;
+
+        if (array->playback_fifo[0] == '\0')
+        {
+            snprintf(array->playback_fifo, sizeof(array->playback_fifo), "/tmp/%s.input", array->name);
+        }
+        if (array->out_fifo[0] == '\0')
+        {
+            snprintf(array->out_fifo, sizeof(array->out_fifo), "/tmp/%s.output", array->name);
+        }
+        conf->playback_fifo = array->playback_fifo;
+        conf->out_fifo = array->out_fifo;
+        conf->delay = array->delay;
+
+        conf->out_channels = conf->rec_channels;
+        if (array->loopback_list_str)
+        {
+            if (array->mic_list_str == NULL)
+            {
+                printf("%s: microphone channels are not set, use 'm=' to set them\n", array->name);
+                exit(1);
+            }
+            conf->bypass = 0;
+        }
+    }
+
+    if (daemon)
+    {
+        daemonize();
+    }
+
+    if (workers < 1)
+    {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers > count)
+        {
+            workers = count;
+        }
+    }
+
+    kernels_init();
+
+    arena_init(ARENA_RESERVE + (trace_file ? trace_size(defaults.frame_ms) : 0));
+
+    if (trace_file)
+    {
+        trace_init(trace_file, defaults.frame_ms);
+    }
+
+    // Configures signal handling.
+    struct sigaction sig_int_handler;
+    sig_int_handler.sa_handler = int_handler;
+    sigemptyset(&sig_int_handler.sa_mask);
+    sig_int_handler.sa_flags = 0;
+    sigaction(SIGINT, &sig_int_handler, NULL);
+
+    // a reader leaving the output FIFO is seen as EPIPE, and processing idles until the next one
+    signal(SIGPIPE, SIG_IGN);
+
+    pool_t *pool = pool_create(workers);
+
+    for (int i = 0; i < count; i++)
+    {
+        array_t *array = &g_arrays[i];
+        conf_t *conf = &array->conf;
+
+        array->pool = pool;
+        array->pipeline = (pipeline_t *)arena_alloc("pipelines", sizeof(pipeline_t));
+
+        printf("%s: ", array->name);
+        if (array->loopback_list_str)
+        {
+            int mic_list[MAX_CHANNELS];
+            int loopback_list[MAX_CHANNELS];
+
+            conf->ref_channels = parse_list(array->name, array->loopback_list_str, loopback_list, conf->rec_channels);
+            conf->out_channels = parse_list(array->name, array->mic_list_str, mic_list, conf->rec_channels);
+            pipeline_init(array->pipeline, conf, mic_list, loopback_list);
+        }
+        else
+        {
+            pipeline_init(array->pipeline, conf, NULL, NULL);
+            playback_start(conf);
+        }
+
+        capture_start(conf);
+        fifo_setup(conf);
+    }
+
+    if (defaults.recorder_seconds)
+    {
+        struct sigaction sig_dump_handler;
+        sig_dump_handler.sa_handler = dump_handler;
+        sigemptyset(&sig_dump_handler.sa_mask);
+        sig_dump_handler.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sig_dump_handler, NULL);
+
+        recorder_start();
+        control_register("dump", dump_command, NULL);
+    }
+    control_start(defaults.control_fifo);
+
+    // nothing is allocated from here on
+    arena_seal();
+
+    if (defaults.single_thread)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            g_confs[i] = &g_arrays[i].conf;
+        }
+        g_count = count;
+        pthread_create(&loop, NULL, loop_thread, NULL);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        array_t *array = &g_arrays[i];
+
+        // system delay between recording and playback
+        printf("%s: skip frames %d\n", array->name, capture_skip(&array->conf, array->delay));
+
+        array->conf.capture_notify_arg = array;
+        __atomic_store_n(&array->conf.capture_notify, capture_notify, __ATOMIC_RELEASE);
+    }
+
+    printf("Running %d arrays... Press Ctrl+C to exit\n", count);
+
+    while (!g_is_quit)
+    {
+        sleep(1);
+        stats_write(defaults.stats_file);
+    }
+
+    pool_destroy(pool);
+
+    if (defaults.single_thread)
+    {
+        pthread_join(loop, NULL);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        capture_stop(&g_arrays[i].conf);
+        if (g_arrays[i].loopback_list_str == NULL)
+        {
+            playback_stop(&g_arrays[i].conf);
+        }
+    }
+
+    trace_write();
+
+    arena_destroy();
+
+    exit(0);
+
+    return 0;
+}
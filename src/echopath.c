@@ -0,0 +1,136 @@
+// echopath.c - detect echo path changes and recover from them quickly
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "echopath.h"
+#include "kernels.h"
+#include "stats.h"
+
+#define FAR_ACTIVE 10000.0      // mean far end power, about -50 dBFS
+#define ERLE_CONVERGED 10.0     // dB, a filter below this has not learnt the echo path yet
+#define ERLE_DROP 10.0          // dB below the converged ERLE
+#define CHANGE_MS 200           // of far end activity with the ERLE dropped
+#define RESET_MS 1000           // before resetting the main filter
+#define RESET_MARGIN 6.0        // dB, the fast filter has to do this much better
+#define CAUGHT_UP_MARGIN 1.0    // dB
+#define CAUGHT_UP_MS 500
+#define RECOVER_MAX_S 20
+
+static double power(const int16_t *buf, int samples)
+{
+    return kernel_energy_s16(buf, samples) / samples;
+}
+
+static double erle_db(double near, double out)
+{
+    return 10 * log10((near + 1) / (out + 1));
+}
+
+void echopath_init(echopath_t *ep, unsigned rate, const char *name)
+{
+    memset(ep, 0, sizeof(*ep));
+    ep->name = name ? name : "";
+    ep->rate = rate;
+
+    stats_name(ep->stat_erle, sizeof(ep->stat_erle), name, "erle_db");
+    stats_name(ep->stat_changes, sizeof(ep->stat_changes), name, "echo_path_changes");
+    stats_name(ep->stat_resets, sizeof(ep->stat_resets), name, "echo_path_resets");
+
+    stats_set(ep->stat_changes, 0);
+    stats_set(ep->stat_resets, 0);
+}
+
+// Account one frame cancelled by the main filter into `out`, and by the fast filter into
+// `fast_out` while recovering. Return what the pipeline has to do next.
+int echopath_update(echopath_t *ep, const int16_t *near, const int16_t *far, const int16_t *out,
+                    const int16_t *fast_out, int frame_size, int out_channels, int ref_channels)
+{
+    int frames_per_s = ep->rate / frame_size;
+
+    if (power(far, frame_size * ref_channels) < FAR_ACTIVE)
+    {
+        // nothing to learn from, and the ERLE means nothing without echo
+        return ECHOPATH_NONE;
+    }
+
+    double near_power = power(near, frame_size * out_channels);
+    ep->erle = 0.8 * ep->erle + 0.2 * erle_db(near_power, power(out, frame_size * out_channels));
+
+    if (!ep->recovering)
+    {
+        ep->erle_converged = 0.995 * ep->erle_converged + 0.005 * ep->erle;
+        stats_set(ep->stat_erle, lround(ep->erle_converged));
+
+        if (ep->erle_converged < ERLE_CONVERGED || ep->erle > ep->erle_converged - ERLE_DROP)
+        {
+            ep->low = 0;
+            return ECHOPATH_NONE;
+        }
+
+        // near end talk drops the ERLE too, but rarely for this long without a pause
+        if (++ep->low < (unsigned)frames_per_s * CHANGE_MS / 1000)
+        {
+            return ECHOPATH_NONE;
+        }
+
+        ep->changes++;
+        ep->recovering = 1;
+        ep->reset = 0;
+        ep->good = 0;
+        ep->erle_fast = 0;
+        stats_set(ep->stat_changes, ep->changes);
+        printf("Echo path%s%s changed: ERLE %.1f dB, was %.1f dB\n",
+               ep->name[0] ? " " : "", ep->name, ep->erle, ep->erle_converged);
+
+        return ECHOPATH_START;
+    }
+
+    ep->recovering++;
+    if (fast_out)
+    {
+        ep->erle_fast = 0.8 * ep->erle_fast + 0.2 * erle_db(near_power, power(fast_out, frame_size * out_channels));
+    }
+
+    // back where it was, or as good as the fast filter once that has learnt the new path
+    if (ep->erle >= ep->erle_converged - CAUGHT_UP_MARGIN * 3 ||
+        (ep->erle_fast >= ERLE_CONVERGED && ep->erle >= ep->erle_fast - CAUGHT_UP_MARGIN))
+    {
+        ep->good++;
+    }
+    else
+    {
+        ep->good = 0;
+    }
+
+    if (ep->good >= (unsigned)frames_per_s * CAUGHT_UP_MS / 1000 ||
+        ep->recovering >= (unsigned)frames_per_s * RECOVER_MAX_S)
+    {
+        printf("Echo path%s%s recovered in %u ms: ERLE %.1f dB\n",
+               ep->name[0] ? " " : "", ep->name, ep->recovering * 1000 / frames_per_s, ep->erle);
+
+        ep->recovering = 0;
+        ep->low = 0;
+        // the new path may not be cancelled as well as the old one
+        ep->erle_converged = ep->erle;
+
+        return ECHOPATH_DONE;
+    }
+
+    // near end talk leaves both filters bad, only a main filter stuck on the old path
+    // does much worse than the fast one
+    if (!ep->reset && ep->recovering >= (unsigned)frames_per_s * RESET_MS / 1000 &&
+        (fast_out ? ep->erle_fast > ep->erle + RESET_MARGIN : ep->erle < ep->erle_converged - ERLE_DROP))
+    {
+        ep->reset = 1;
+        ep->resets++;
+        stats_set(ep->stat_resets, ep->resets);
+        printf("Echo path%s%s: reset the echo filter, ERLE %.1f dB, %.1f dB with the fast filter\n",
+               ep->name[0] ? " " : "", ep->name, ep->erle, ep->erle_fast);
+
+        return ECHOPATH_RESET;
+    }
+
+    return ECHOPATH_NONE;
+}
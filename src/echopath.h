@@ -0,0 +1,38 @@
+#ifndef _ECHOPATH_H_
+#define _ECHOPATH_H_
+
+#include <stdint.h>
+
+// What the pipeline does after a frame
+enum
+{
+    ECHOPATH_NONE = 0,
+    ECHOPATH_START,         // the echo path changed, reset the fast filter and run it alongside
+    ECHOPATH_RESET,         // the fast filter does much better, reset the main one
+    ECHOPATH_DONE           // the main filter has caught up, stop the fast one
+};
+
+// Detect abrupt echo path changes, e.g. a volume change or a moved speaker, from a sudden
+// drop of the echo return loss enhancement (ERLE) while the far end is active
+typedef struct _echopath_t {
+    const char *name;       // pipeline name
+    unsigned rate;          // of the echo canceller
+    double erle;            // dB, over about 50 ms
+    double erle_fast;       // dB, of the fast filter while recovering
+    double erle_converged;  // dB, over a few seconds while not recovering
+    unsigned low;           // frames of far end activity with the ERLE far below the converged one
+    unsigned good;          // frames with the main filter as good as the fast one
+    unsigned recovering;    // frames since the change, 0 if not recovering
+    int reset;              // the main filter was reset during this recovery
+    unsigned changes;
+    unsigned resets;
+    char stat_erle[48];
+    char stat_changes[48];
+    char stat_resets[48];
+} echopath_t;
+
+void echopath_init(echopath_t *ep, unsigned rate, const char *name);
+int echopath_update(echopath_t *ep, const int16_t *near, const int16_t *far, const int16_t *out,
+                    const int16_t *fast_out, int frame_size, int out_channels, int ref_channels);
+
+#endif // _ECHOPATH_H_
@@ -1,75 +1,213 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
+#include "arena.h"
 #include "pa_ringbuffer.h"
 #include "conf.h"
+#include "fifo.h"
+#include "ring.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 extern int g_is_quit;
 
-PaUtilRingBuffer g_out_ringbuffer;
+#define FIFO_CHUNK 512          // frames taken from the ring per write to the FIFO
+#define FIFO_GAP_MS 10          // zeroed audio marking a discontinuity
+#define FIFO_DEADLINE_MS 100    // default longest wait for the reader with FIFO_BLOCK
 
-void *fifo_thread(void *ptr)
+static const char *policy_names[FIFO_POLICIES] = {
+    "oldest",
+    "newest",
+    "block"
+};
+
+typedef struct _fifo_t
 {
-    conf_t *conf = (conf_t *)ptr;
-    ring_buffer_size_t size1, size2, available;
-    void *data1, *data2;
-    int fd = open(conf->out_fifo, O_WRONLY);      // will block until reader is available
-    if (fd < 0) {
-        printf("failed to open %s, error %d\n", conf->out_fifo, fd);
-        return NULL;
+    PaUtilRingBuffer ring;
+    pthread_t writer;
+    // the read index moves under the lock, so fifo_write() can drop the oldest audio
+    pthread_mutex_t lock;
+    pthread_cond_t consumed;
+    int mirrored;               // see ring.h
+    int in_place;               // written to the reader straight from the ring, not with FIFO_DROP_OLDEST
+    char *chunk;                // audio on its way to the reader, out of the ring
+    char *data;                 // the chunk, or the frames in the ring when written in place
+    ring_buffer_size_t held;    // frames in the ring being written in place
+    unsigned chunk_bytes;       // left to write in single thread mode
+    unsigned chunk_offset;
+    int connected;              // a reader has the FIFO open, see fifo_connected()
+    int gap;                    // audio was dropped since the last write
+    unsigned gap_frames;
+    char stat_dropped[FIFO_POLICIES][48];
+    char stat_gaps[48];
+    char stat_blocked[48];
+    char stat_backlog[48];
+} fifo_t;
+
+// Take up to FIFO_CHUNK frames for the reader. With FIFO_DROP_OLDEST fifo_write() moves the
+// read index, so they are copied out of the ring. Otherwise they are written in place and
+// stay in the ring until fifo_release(). Called with the lock held.
+static ring_buffer_size_t fifo_take(fifo_t *fifo)
+{
+    PaUtilRingBuffer *ring = &fifo->ring;
+    void *data;
+
+    if (!fifo->in_place)
+    {
+        fifo->data = fifo->chunk;
+        return PaUtil_ReadRingBuffer(ring, fifo->chunk, FIFO_CHUNK);
     }
 
-    // clear
-    PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer));
-    while (!g_is_quit)
+    fifo->held = ring_read_window(ring, fifo->mirrored, FIFO_CHUNK, &data);
+    fifo->data = data;
+
+    return fifo->held;
+}
+
+// Give the frames written in place back to the ring. Called with the lock held.
+static void fifo_release(fifo_t *fifo)
+{
+    if (fifo->held > 0)
+    {
+        PaUtil_AdvanceRingBufferReadIndex(&fifo->ring, fifo->held);
+        fifo->held = 0;
+        pthread_cond_signal(&fifo->consumed);
+    }
+}
+
+// Write queued audio to a reader until it closes the FIFO or quit
+static void fifo_pump(fifo_t *fifo, int fd)
+{
+    PaUtilRingBuffer *ring = &fifo->ring;
+    int gone = 0;
+
+    while (!g_is_quit && !gone)
     {
-        available = PaUtil_GetRingBufferReadAvailable(&g_out_ringbuffer);
-        PaUtil_GetRingBufferReadRegions(&g_out_ringbuffer, available, &data1, &size1, &data2, &size2);
-        if (size1 > 0) {
-            int result = write(fd, data1, size1 * g_out_ringbuffer.elementSizeBytes);
-            // printf("write %d of %d\n", result / 2, size1);
+        pthread_mutex_lock(&fifo->lock);
+        stats_set(fifo->stat_backlog, PaUtil_GetRingBufferReadAvailable(ring));
+        ring_buffer_size_t frames = fifo_take(fifo);
+        pthread_cond_signal(&fifo->consumed);
+        pthread_mutex_unlock(&fifo->lock);
+
+        if (frames == 0) {
+            usleep(100000);
+            continue;
+        }
+
+        char *data = fifo->data;
+        size_t bytes = frames * ring->elementSizeBytes;
+        while (bytes > 0 && !g_is_quit) {
+            TRACE_BEGIN("fifo_write");
+            int result = write(fd, data, bytes);
+            TRACE_END("fifo_write");
             if (result > 0) {
-                PaUtil_AdvanceRingBufferReadIndex(&g_out_ringbuffer, result / g_out_ringbuffer.elementSizeBytes);
+                data += result;
+                bytes -= result;
+            } else if (result < 0 && errno == EPIPE) {
+                gone = 1;
+                break;
             } else {
                 sleep(1);
             }
-        } else {
-            usleep(100000);
         }
+
+        pthread_mutex_lock(&fifo->lock);
+        fifo_release(fifo);
+        pthread_mutex_unlock(&fifo->lock);
     }
+}
+
+void *fifo_thread(void *ptr)
+{
+    conf_t *conf = (conf_t *)ptr;
+    fifo_t *fifo = conf->fifo;
+    PaUtilRingBuffer *ring = &fifo->ring;
 
-    close(fd);
+    trace_thread("fifo");
+
+    while (!g_is_quit)
+    {
+        int fd = open(conf->out_fifo, O_WRONLY);      // will block until reader is available
+        if (fd < 0) {
+            printf("failed to open %s, error %d\n", conf->out_fifo, fd);
+            return NULL;
+        }
+
+        // clear
+        pthread_mutex_lock(&fifo->lock);
+        PaUtil_AdvanceRingBufferReadIndex(ring, PaUtil_GetRingBufferReadAvailable(ring));
+        __atomic_store_n(&fifo->connected, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&fifo->lock);
+
+        fifo_pump(fifo, fd);
+
+        // the reader has gone, wait for the next one
+        __atomic_store_n(&fifo->connected, 0, __ATOMIC_RELEASE);
+        close(fd);
+    }
 
     return NULL;
 }
 
+// Whether a reader has the output FIFO open, processing idles without one
+int fifo_connected(conf_t *conf)
+{
+    return __atomic_load_n(&conf->fifo->connected, __ATOMIC_ACQUIRE);
+}
+
 int fifo_setup(conf_t *conf)
 {
-    pthread_t writer;
     struct stat st;
 
-    unsigned buffer_size = power2(conf->buffer_size);
+    // room for a reader lagging up to the deadline, a batch, a write to the FIFO and stalls
+    unsigned deadline_ms = conf->out_policy == FIFO_BLOCK ? conf->out_deadline_ms : FIFO_DEADLINE_MS;
+    unsigned needed = conf->rate * (deadline_ms + RING_SLACK_MS) / 1000
+                      + conf->max_batch * conf->rate * conf->frame_ms / 1000 + FIFO_CHUNK;
+    unsigned buffer_size = power2(conf->buffer_size ? conf->buffer_size : needed);
     unsigned buffer_bytes = conf->out_channels * conf->bits_per_sample / 8;
 
-    void *buf = calloc(buffer_size, buffer_bytes);
-    if (buf == NULL)
+    conf->fifo = arena_alloc("output ring", sizeof(fifo_t));
+    fifo_t *fifo = conf->fifo;
+    fifo->mirrored = ring_init(&fifo->ring, "output ring", buffer_bytes, buffer_size);
+    pthread_mutex_init(&fifo->lock, NULL);
+    pthread_cond_init(&fifo->consumed, NULL);
+    fifo->gap_frames = conf->out_gap_marker ? conf->rate * FIFO_GAP_MS / 1000 : 0;
+
+    char name[32];
+    for (int i = 0; i < FIFO_POLICIES; i++)
+    {
+        snprintf(name, sizeof(name), "out_dropped_%s_frames", policy_names[i]);
+        stats_name(fifo->stat_dropped[i], sizeof(fifo->stat_dropped[i]), conf->name, name);
+    }
+    stats_name(fifo->stat_gaps, sizeof(fifo->stat_gaps), conf->name, "out_gaps");
+    stats_name(fifo->stat_blocked, sizeof(fifo->stat_blocked), conf->name, "out_blocked_us");
+    stats_name(fifo->stat_backlog, sizeof(fifo->stat_backlog), conf->name, "out_backlog_frames");
+    stats_set(fifo->stat_dropped[conf->out_policy], 0);
+    stats_set(fifo->stat_gaps, 0);
+
+
+    fifo->in_place = conf->out_policy != FIFO_DROP_OLDEST;
+    if (!fifo->in_place)
     {
-        fprintf(stderr, "Fail to allocate memory.\n");
-        exit(1);
+        fifo->chunk = arena_alloc("output ring", FIFO_CHUNK * buffer_bytes);
     }
 
-    ring_buffer_size_t ret = PaUtil_InitializeRingBuffer(&g_out_ringbuffer, buffer_bytes, buffer_size, buf);
-    if (ret == -1)
+    if (conf->out_policy == FIFO_BLOCK)
+    {
+        printf("%s overflow policy: block up to %u ms\n", conf->out_fifo, conf->out_deadline_ms);
+    }
+    else
     {
-        fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
-        exit(1);
+        printf("%s overflow policy: drop %s\n", conf->out_fifo, policy_names[conf->out_policy]);
     }
 
     if (stat(conf->out_fifo, &st) != 0) {
@@ -79,13 +217,219 @@ int fifo_setup(conf_t *conf)
         mkfifo(conf->out_fifo, 0666);
     }
 
-    pthread_create(&writer, NULL, fifo_thread, conf);
+    // in single thread mode the event loop writes the FIFO, see fifo_loop_write()
+    if (!conf->single_thread)
+    {
+        pthread_create(&conf->fifo->writer, NULL, fifo_thread, conf);
+    }
 
     return 0;
 }
 
+// Parse "oldest", "newest" or "block[:ms]"
+int fifo_parse_policy(conf_t *conf, const char *arg)
+{
+    for (int i = 0; i < FIFO_POLICIES; i++)
+    {
+        size_t len = strlen(policy_names[i]);
+        if (strncmp(arg, policy_names[i], len) == 0 && (arg[len] == '\0' || (i == FIFO_BLOCK && arg[len] == ':')))
+        {
+            conf->out_policy = i;
+            conf->out_deadline_ms = arg[len] == ':' ? atoi(arg + len + 1) : FIFO_DEADLINE_MS;
+            return 0;
+        }
+    }
+
+    return -1;
+}
 
-int fifo_write(void *buf, size_t frames)
+// Single thread mode: open the output FIFO if a reader has opened it, without blocking.
+// Return the descriptor, -1 while there is no reader.
+int fifo_loop_open(conf_t *conf)
 {
-    return PaUtil_WriteRingBuffer(&g_out_ringbuffer, buf, frames);
+    fifo_t *fifo = conf->fifo;
+
+    int fd = open(conf->out_fifo, O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // clear
+    pthread_mutex_lock(&fifo->lock);
+    PaUtil_AdvanceRingBufferReadIndex(&fifo->ring, PaUtil_GetRingBufferReadAvailable(&fifo->ring));
+    __atomic_store_n(&fifo->connected, 1, __ATOMIC_RELEASE);
+    fifo->held = 0;
+    fifo->chunk_bytes = 0;
+    pthread_mutex_unlock(&fifo->lock);
+
+    return fd;
+}
+
+// Single thread mode: write queued audio to the output FIFO until it would block.
+// Return 1 if audio is left, 0 if all is written, -1 if the reader has gone.
+int fifo_loop_write(conf_t *conf, int fd)
+{
+    fifo_t *fifo = conf->fifo;
+    PaUtilRingBuffer *ring = &fifo->ring;
+
+    while (1)
+    {
+        if (fifo->chunk_bytes == 0)
+        {
+            pthread_mutex_lock(&fifo->lock);
+            fifo_release(fifo);
+            stats_set(fifo->stat_backlog, PaUtil_GetRingBufferReadAvailable(ring));
+            ring_buffer_size_t frames = fifo_take(fifo);
+            pthread_mutex_unlock(&fifo->lock);
+
+            if (frames == 0)
+            {
+                return 0;
+            }
+            fifo->chunk_bytes = frames * ring->elementSizeBytes;
+            fifo->chunk_offset = 0;
+        }
+
+        TRACE_BEGIN("fifo_write");
+        int result = write(fd, fifo->data + fifo->chunk_offset, fifo->chunk_bytes);
+        TRACE_END("fifo_write");
+        if (result < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                return 1;
+            }
+            __atomic_store_n(&fifo->connected, 0, __ATOMIC_RELEASE);
+            return -1;
+        }
+
+        fifo->chunk_offset += result;
+        fifo->chunk_bytes -= result;
+    }
+}
+
+static void fifo_zero(PaUtilRingBuffer *ring, ring_buffer_size_t frames, int read_side)
+{
+    ring_buffer_size_t size1, size2;
+    void *data1, *data2;
+
+    if (read_side)
+    {
+        PaUtil_GetRingBufferReadRegions(ring, frames, &data1, &size1, &data2, &size2);
+    }
+    else
+    {
+        PaUtil_GetRingBufferWriteRegions(ring, frames, &data1, &size1, &data2, &size2);
+    }
+
+    memset(data1, 0, size1 * ring->elementSizeBytes);
+    if (size2 > 0)
+    {
+        memset(data2, 0, size2 * ring->elementSizeBytes);
+    }
+}
+
+// Wait for the reader to make room for `frames` frames until the deadline. Called with the lock held.
+static void fifo_wait(conf_t *conf, ring_buffer_size_t frames)
+{
+    fifo_t *fifo = conf->fifo;
+    struct timespec deadline;
+    double start = now_us();
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += conf->out_deadline_ms / 1000;
+    deadline.tv_nsec += (conf->out_deadline_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    TRACE_BEGIN("out_blocked");
+    while (PaUtil_GetRingBufferWriteAvailable(&fifo->ring) < frames && !g_is_quit)
+    {
+        if (pthread_cond_timedwait(&fifo->consumed, &fifo->lock, &deadline) != 0)
+        {
+            break;
+        }
+    }
+    TRACE_END("out_blocked");
+
+    stats_add(fifo->stat_blocked, (long)(now_us() - start));
+}
+
+// Queue `frames` frames for the output FIFO, applying the overflow policy when the reader lags.
+// Return the number of frames dropped.
+int fifo_write(conf_t *conf, void *buf, size_t frames)
+{
+    fifo_t *fifo = conf->fifo;
+    PaUtilRingBuffer *ring = &fifo->ring;
+    char *data = (char *)buf;
+    ring_buffer_size_t dropped = 0;
+
+    if (PaUtil_GetRingBufferWriteAvailable(ring) < (ring_buffer_size_t)frames)
+    {
+        pthread_mutex_lock(&fifo->lock);
+
+        if (conf->out_policy == FIFO_DROP_OLDEST)
+        {
+            ring_buffer_size_t needed = frames - PaUtil_GetRingBufferWriteAvailable(ring);
+            ring_buffer_size_t queued = PaUtil_GetRingBufferReadAvailable(ring);
+            if (needed > queued)
+            {
+                needed = queued;
+            }
+            if (needed > 0)
+            {
+                PaUtil_AdvanceRingBufferReadIndex(ring, needed);
+                stats_add(fifo->stat_dropped[FIFO_DROP_OLDEST], needed);
+                stats_add(fifo->stat_gaps, 1);
+
+                // the reader continues right after the gap
+                queued -= needed;
+                fifo_zero(ring, fifo->gap_frames < (unsigned)queued ? fifo->gap_frames : queued, 1);
+            }
+        }
+        else if (conf->out_policy == FIFO_BLOCK && fifo->connected)
+        {
+            fifo_wait(conf, frames);
+        }
+
+        pthread_mutex_unlock(&fifo->lock);
+    }
+
+    ring_buffer_size_t space = PaUtil_GetRingBufferWriteAvailable(ring);
+    if (space < (ring_buffer_size_t)frames)
+    {
+        dropped = frames - space;
+        frames = space;
+    }
+
+    // the first audio after dropping the newest
+    if (fifo->gap && frames > 0)
+    {
+        fifo->gap = 0;
+
+        ring_buffer_size_t zeros = fifo->gap_frames < frames ? fifo->gap_frames : frames;
+        fifo_zero(ring, zeros, 0);
+        PaUtil_AdvanceRingBufferWriteIndex(ring, zeros);
+        data += zeros * ring->elementSizeBytes;
+        frames -= zeros;
+    }
+
+    PaUtil_WriteRingBuffer(ring, data, frames);
+
+    if (dropped > 0)
+    {
+        // more than the whole ring is dropped from the newest audio with FIFO_DROP_OLDEST too
+        stats_add(fifo->stat_dropped[conf->out_policy == FIFO_BLOCK ? FIFO_BLOCK : FIFO_DROP_NEWEST], dropped);
+        if (!fifo->gap)
+        {
+            fifo->gap = 1;
+            stats_add(fifo->stat_gaps, 1);
+        }
+    }
+
+    return dropped;
 }
@@ -0,0 +1,24 @@
+#ifndef _FIFO_H_
+#define _FIFO_H_
+
+#include <stddef.h>
+
+#include "conf.h"
+
+// What fifo_write() does when the output FIFO reader falls behind and the ring is full
+enum
+{
+    FIFO_DROP_OLDEST = 0,   // discard the oldest queued audio, latency stays bounded
+    FIFO_DROP_NEWEST,       // discard the audio being written
+    FIFO_BLOCK,             // wait up to the deadline for the reader, then drop the newest
+    FIFO_POLICIES
+};
+
+int fifo_setup(conf_t *conf);
+int fifo_write(conf_t *conf, void *buf, size_t frames);
+int fifo_parse_policy(conf_t *conf, const char *arg);
+int fifo_connected(conf_t *conf);
+int fifo_loop_open(conf_t *conf);
+int fifo_loop_write(conf_t *conf, int fd);
+
+#endif // _FIFO_H_
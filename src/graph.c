@@ -0,0 +1,218 @@
+// graph.c - pipelined processing stages
+//
+// The caller is the source: it takes a free frame from the pool, fills it and puts it
+// into the first queue. Every stage thread takes frames from its queue, processes them
+// and passes them on, and the last one returns them to the pool. Each queue has exactly
+// one producer and one consumer, so it is a PortAudio ring buffer of frame pointers
+// with a semaphore to sleep on when it is empty. The frames are preallocated, so with
+// one frame per stage plus the one being filled, a stage adds at most one frame of latency.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <time.h>
+
+#include "arena.h"
+#include "graph.h"
+#include "pa_ringbuffer.h"
+#include "trace.h"
+
+#define GRAPH_MAX_STAGES 8
+#define GRAPH_MAX_FRAMES 64     // power of 2
+
+typedef struct
+{
+    PaUtilRingBuffer ring;      // frame pointers
+    sem_t items;
+} queue_t;
+
+typedef struct
+{
+    graph_t *graph;
+    const char *name;
+    void (*fn)(void *arg, void *frame);
+    void *arg;
+    queue_t *in;
+    queue_t *out;
+    pthread_t thread;
+} stage_t;
+
+struct _graph_t
+{
+    int stages;
+    int count;
+    volatile int quit;
+    queue_t queues[GRAPH_MAX_STAGES + 1];     // free frames, then the input of each stage
+    stage_t stage[GRAPH_MAX_STAGES];
+};
+
+static void queue_init(queue_t *q)
+{
+    void *data = arena_alloc("graph queues", GRAPH_MAX_FRAMES * sizeof(void *));
+    PaUtil_InitializeRingBuffer(&q->ring, sizeof(void *), GRAPH_MAX_FRAMES, data);
+    sem_init(&q->items, 0, 0);
+}
+
+static void queue_push(queue_t *q, void *frame)
+{
+    PaUtil_WriteRingBuffer(&q->ring, &frame, 1);
+    sem_post(&q->items);
+}
+
+// NULL on timeout or quit, a negative timeout waits until either
+static void *queue_pop(graph_t *graph, queue_t *q, int timeout_ms)
+{
+    void *frame = NULL;
+    int err;
+
+    if (timeout_ms < 0)
+    {
+        while ((err = sem_wait(&q->items)) != 0 && errno == EINTR)
+        {
+        }
+    }
+    else
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while ((err = sem_timedwait(&q->items, &deadline)) != 0 && errno == EINTR)
+        {
+        }
+    }
+
+    if (err != 0 || graph->quit)
+    {
+        return NULL;
+    }
+
+    PaUtil_ReadRingBuffer(&q->ring, &frame, 1);
+
+    return frame;
+}
+
+static void *stage_thread(void *ptr)
+{
+    stage_t *stage = (stage_t *)ptr;
+    graph_t *graph = stage->graph;
+
+    trace_thread(stage->name);
+
+    while (!graph->quit)
+    {
+        void *frame = queue_pop(graph, stage->in, -1);
+        if (frame == NULL)
+        {
+            break;
+        }
+
+        stage->fn(stage->arg, frame);
+        queue_push(stage->out, frame);
+    }
+
+    return NULL;
+}
+
+// The frames are allocated by the caller, all of them start in the pool
+graph_t *graph_create(void **frames, int count)
+{
+    if (count < 1 || count > GRAPH_MAX_FRAMES)
+    {
+        printf("A graph takes 1 to %d frames\n", GRAPH_MAX_FRAMES);
+        exit(1);
+    }
+
+    graph_t *graph = (graph_t *)arena_alloc("graph", sizeof(graph_t));
+    memset(graph, 0, sizeof(*graph));
+    graph->count = count;
+
+    queue_init(&graph->queues[0]);
+
+    for (int i = 0; i < count; i++)
+    {
+        queue_push(&graph->queues[0], frames[i]);
+    }
+
+    return graph;
+}
+
+// Stages run in the order they are added
+void graph_add_stage(graph_t *graph, const char *name, void (*fn)(void *arg, void *frame), void *arg)
+{
+    if (graph->stages >= GRAPH_MAX_STAGES)
+    {
+        printf("Too many graph stages\n");
+        exit(1);
+    }
+
+    int index = graph->stages++;
+    queue_init(&graph->queues[index + 1]);
+
+    stage_t *stage = &graph->stage[index];
+    stage->graph = graph;
+    stage->name = name;
+    stage->fn = fn;
+    stage->arg = arg;
+    stage->in = &graph->queues[index + 1];
+}
+
+void graph_start(graph_t *graph)
+{
+    if (graph->stages < 1)
+    {
+        printf("A graph needs at least one stage\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < graph->stages; i++)
+    {
+        stage_t *stage = &graph->stage[i];
+        stage->out = i + 1 < graph->stages ? &graph->queues[i + 2] : &graph->queues[0];
+
+        if (pthread_create(&stage->thread, NULL, stage_thread, stage))
+        {
+            printf("Fail to create %s thread\n", stage->name);
+            exit(1);
+        }
+    }
+
+    printf("Processing graph of %d stages, %d frames\n", graph->stages, graph->count);
+}
+
+// Take a free frame to fill, NULL if all are still in the stages after timeout_ms
+void *graph_get(graph_t *graph, int timeout_ms)
+{
+    return queue_pop(graph, &graph->queues[0], timeout_ms);
+}
+
+// Pass a filled frame to the first stage
+void graph_put(graph_t *graph, void *frame)
+{
+    queue_push(&graph->queues[1], frame);
+}
+
+// Frames still in the stages are dropped
+void graph_stop(graph_t *graph)
+{
+    graph->quit = 1;
+
+    for (int i = 0; i < graph->stages; i++)
+    {
+        sem_post(&graph->stage[i].in->items);
+    }
+
+    for (int i = 0; i < graph->stages; i++)
+    {
+        pthread_join(graph->stage[i].thread, NULL);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef _GRAPH_H_
+#define _GRAPH_H_
+
+// A chain of processing stages, each on its own thread, passing frames through
+// lock-free single producer single consumer queues
+
+typedef struct _graph_t graph_t;
+
+graph_t *graph_create(void **frames, int count);
+void graph_add_stage(graph_t *graph, const char *name, void (*fn)(void *arg, void *frame), void *arg);
+void graph_start(graph_t *graph);
+void *graph_get(graph_t *graph, int timeout_ms);
+void graph_put(graph_t *graph, void *frame);
+void graph_stop(graph_t *graph);
+
+#endif // _GRAPH_H_
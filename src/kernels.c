@@ -0,0 +1,323 @@
+// kernels.c - SIMD versions of the sample loops
+//
+// One binary runs on every CPU of its architecture: the SIMD versions are compiled
+// with target attributes instead of global -m flags, and kernels_init() picks the best
+// set the CPU supports. x86 has SSE2 and AVX2 sets, ARM a NEON set when the compiler
+// targets it, checked at runtime on 32-bit ARM where NEON is optional.
+//
+// Channel picking shuffles whole frames within 16 byte lanes, so the SIMD versions
+// handle 1, 2, 4 or 8 source channels and fall back to the scalar loop otherwise.
+// SSE2 has no byte shuffle, its set uses the scalar pick.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "kernels.h"
+
+static void pick_s16_scalar(int16_t *dst, unsigned dst_channels, const int16_t *src, unsigned src_channels,
+                            const int *list, size_t frames)
+{
+    for (size_t i = 0; i < frames; i++)
+    {
+        for (unsigned ch = 0; ch < dst_channels; ch++)
+        {
+            dst[i * dst_channels + ch] = src[i * src_channels + list[ch]];
+        }
+    }
+}
+
+static double energy_s16_scalar(const int16_t *buf, size_t samples)
+{
+    double sum = 0;
+    for (size_t i = 0; i < samples; i++)
+    {
+        sum += (double)buf[i] * buf[i];
+    }
+
+    return sum;
+}
+
+static float dot_f32_scalar(const float *a, const float *b, size_t n)
+{
+    float sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+kernels_t g_kernels = {
+    .name = "scalar",
+    .pick_s16 = pick_s16_scalar,
+    .energy_s16 = energy_s16_scalar,
+    .dot_f32 = dot_f32_scalar
+};
+
+// Byte shuffle of one 16 byte lane that picks the channels of the 8 / src_channels frames
+// in it, packed. Return the number of samples it yields, 0 if the layout isn't supported.
+static unsigned pick_mask(uint8_t mask[16], unsigned dst_channels, unsigned src_channels, const int *list)
+{
+    if (src_channels == 0 || 8 % src_channels || dst_channels > src_channels)
+    {
+        return 0;
+    }
+
+    unsigned frames = 8 / src_channels;
+    memset(mask, 0x80, 16);
+    for (unsigned f = 0; f < frames; f++)
+    {
+        for (unsigned ch = 0; ch < dst_channels; ch++)
+        {
+            unsigned word = f * src_channels + list[ch];
+            mask[(f * dst_channels + ch) * 2] = word * 2;
+            mask[(f * dst_channels + ch) * 2 + 1] = word * 2 + 1;
+        }
+    }
+
+    return frames * dst_channels;
+}
+
+#ifdef KERNELS_X86
+
+// squares of -32768 pairs reach 2^31, so the 32-bit pair sums are taken as unsigned
+__attribute__((target("sse2")))
+static double energy_s16_sse2(const int16_t *buf, size_t samples)
+{
+    __m128i acc = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i sq = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+
+    return (double)(lanes[0] + lanes[1]) + energy_s16_scalar(buf + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static float dot_f32_sse2(const float *a, const float *b, size_t n)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dot_f32_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void pick_s16_avx2(int16_t *dst, unsigned dst_channels, const int16_t *src, unsigned src_channels,
+                          const int *list, size_t frames)
+{
+    uint8_t mask[16];
+    unsigned out = pick_mask(mask, dst_channels, src_channels, list);
+    size_t i = 0;
+
+    if (out)
+    {
+        unsigned lane_frames = 8 / src_channels;
+        __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mask));
+
+        // every store writes a whole lane, the samples past `out` are overwritten by the
+        // next one, so stop while a store could pass the end of dst
+        for (; (i + lane_frames) * dst_channels + 8 <= frames * dst_channels && i + 2 * lane_frames <= frames;
+             i += 2 * lane_frames)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(src + i * src_channels));
+            __m256i y = _mm256_shuffle_epi8(x, shuffle);
+            _mm_storeu_si128((__m128i *)(dst + i * dst_channels), _mm256_castsi256_si128(y));
+            _mm_storeu_si128((__m128i *)(dst + i * dst_channels + out), _mm256_extracti128_si256(y, 1));
+        }
+    }
+
+    pick_s16_scalar(dst + i * dst_channels, dst_channels, src + i * src_channels, src_channels, list, frames - i);
+}
+
+__attribute__((target("avx2")))
+static double energy_s16_avx2(const int16_t *buf, size_t samples)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= samples; i += 16)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i sq = _mm256_madd_epi16(x, x);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+
+    return (double)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) + energy_s16_scalar(buf + i, samples - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_f32_avx2(const float *a, const float *b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+
+    float sum = 0;
+    for (int k = 0; k < 8; k++)
+    {
+        sum += lanes[k];
+    }
+
+    return sum + dot_f32_scalar(a + i, b + i, n - i);
+}
+
+#endif // KERNELS_X86
+
+#ifdef KERNELS_NEON
+
+#if defined(__aarch64__)
+static void pick_s16_neon(int16_t *dst, unsigned dst_channels, const int16_t *src, unsigned src_channels,
+                          const int *list, size_t frames)
+{
+    uint8_t mask[16];
+    unsigned out = pick_mask(mask, dst_channels, src_channels, list);
+    size_t i = 0;
+
+    if (out)
+    {
+        unsigned lane_frames = 8 / src_channels;
+        uint8x16_t shuffle = vld1q_u8(mask);
+
+        // as with AVX2, the tail of each store is overwritten by the next one
+        for (; i * dst_channels + 8 <= frames * dst_channels && i + lane_frames <= frames; i += lane_frames)
+        {
+            uint8x16_t x = vld1q_u8((const uint8_t *)(src + i * src_channels));
+            vst1q_u8((uint8_t *)(dst + i * dst_channels), vqtbl1q_u8(x, shuffle));
+        }
+    }
+
+    pick_s16_scalar(dst + i * dst_channels, dst_channels, src + i * src_channels, src_channels, list, frames - i);
+}
+#endif
+
+static double energy_s16_neon(const int16_t *buf, size_t samples)
+{
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 8 <= samples; i += 8)
+    {
+        int16x8_t x = vld1q_s16(buf + i);
+        int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+        int32x4_t hi = vmull_s16(vget_high_s16(x), vget_high_s16(x));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(lo));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(hi));
+    }
+
+    return (double)(vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1)) + energy_s16_scalar(buf + i, samples - i);
+}
+
+static float dot_f32_neon(const float *a, const float *b, size_t n)
+{
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+
+    float lanes[4];
+    vst1q_f32(lanes, vaddq_f32(acc0, acc1));
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dot_f32_scalar(a + i, b + i, n - i);
+}
+
+#endif // KERNELS_NEON
+
+// Pick the kernels for this CPU, EC_KERNELS=scalar or sse2 in the environment keeps the scalar ones
+void kernels_init(void)
+{
+    const char *force = getenv("EC_KERNELS");
+    if (force && strcmp(force, "scalar") == 0)
+    {
+        printf("SIMD kernels: %s\n", g_kernels.name);
+        return;
+    }
+
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        g_kernels.name = "sse2";
+        g_kernels.energy_s16 = energy_s16_sse2;
+        g_kernels.dot_f32 = dot_f32_sse2;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && !(force && strcmp(force, "sse2") == 0))
+    {
+        g_kernels.name = "avx2";
+        g_kernels.pick_s16 = pick_s16_avx2;
+        g_kernels.energy_s16 = energy_s16_avx2;
+        g_kernels.dot_f32 = dot_f32_avx2;
+    }
+#endif
+
+#ifdef KERNELS_NEON
+#if defined(__arm__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    {
+        g_kernels.name = "neon";
+#if defined(__aarch64__)
+        g_kernels.pick_s16 = pick_s16_neon;
+#endif
+        g_kernels.energy_s16 = energy_s16_neon;
+        g_kernels.dot_f32 = dot_f32_neon;
+    }
+#endif
+
+    printf("SIMD kernels: %s\n", g_kernels.name);
+}
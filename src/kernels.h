@@ -0,0 +1,41 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sample loops with SSE2, AVX2 and NEON versions, picked at runtime by kernels_init().
+// The scalar versions are used until then.
+
+typedef struct
+{
+    const char *name;
+    void (*pick_s16)(int16_t *dst, unsigned dst_channels, const int16_t *src, unsigned src_channels,
+                     const int *list, size_t frames);
+    double (*energy_s16)(const int16_t *buf, size_t samples);
+    float (*dot_f32)(const float *a, const float *b, size_t n);
+} kernels_t;
+
+extern kernels_t g_kernels;
+
+void kernels_init(void);
+
+// Copy channels list[0..dst_channels) of interleaved frames to interleaved frames of dst_channels
+static inline void kernel_pick_s16(int16_t *dst, unsigned dst_channels, const int16_t *src, unsigned src_channels,
+                                   const int *list, size_t frames)
+{
+    g_kernels.pick_s16(dst, dst_channels, src, src_channels, list, frames);
+}
+
+// Sum of squares, exact
+static inline double kernel_energy_s16(const int16_t *buf, size_t samples)
+{
+    return g_kernels.energy_s16(buf, samples);
+}
+
+static inline float kernel_dot_f32(const float *a, const float *b, size_t n)
+{
+    return g_kernels.dot_f32(a, b, n);
+}
+
+#endif // _KERNELS_H_
@@ -0,0 +1,112 @@
+// overload.c - step AEC quality down when processing falls behind real time
+
+#include <stdio.h>
+
+#include "overload.h"
+#include "stats.h"
+
+#define LOAD_HIGH 0.8       // step down above this real-time factor
+#define LOAD_LOW 0.5        // step up below this real-time factor
+#define HOLD_MIN_S 5        // headroom required before stepping up
+#define HOLD_MAX_S 300
+
+static const char *level_names[OVERLOAD_LEVELS] = {
+    "full",
+    "short filter",
+    "passthrough"
+};
+
+const char *overload_level_name(int level)
+{
+    return level_names[level];
+}
+
+void overload_init(overload_t *ol, unsigned rate, const char *name)
+{
+    ol->name = name ? name : "";
+    ol->rate = rate;
+    ol->level = OVERLOAD_FULL;
+    ol->load = 0;
+    ol->over = 0;
+    ol->under = 0;
+    ol->hold = rate * HOLD_MIN_S;
+    ol->since_up = rate * HOLD_MAX_S;
+    ol->transitions = 0;
+
+    stats_name(ol->stat_level, sizeof(ol->stat_level), name, "overload_level");
+    stats_name(ol->stat_transitions, sizeof(ol->stat_transitions), name, "overload_transitions");
+    stats_name(ol->stat_load, sizeof(ol->stat_load), name, "load_permille");
+    stats_name(ol->stat_backlog, sizeof(ol->stat_backlog), name, "capture_backlog");
+
+    stats_set(ol->stat_level, ol->level);
+    stats_set(ol->stat_transitions, 0);
+}
+
+static void overload_set_level(overload_t *ol, int level, unsigned backlog)
+{
+    printf("Overload%s%s: %s -> %s (load %.2f, backlog %u ms)\n",
+           ol->name[0] ? " " : "", ol->name, level_names[ol->level], level_names[level], ol->load, backlog * 1000 / ol->rate);
+
+    ol->level = level;
+    ol->over = 0;
+    ol->under = 0;
+    ol->transitions++;
+
+    stats_set(ol->stat_level, level);
+    stats_set(ol->stat_transitions, ol->transitions);
+}
+
+// Account `busy_us` of processing for `frames` frames of audio with `backlog` frames
+// still waiting in the capture ring buffer. Return the level to process the next frames with.
+int overload_update(overload_t *ol, double busy_us, unsigned frames, unsigned backlog)
+{
+    double audio_us = frames * 1e6 / ol->rate;
+
+    ol->load = 0.9 * ol->load + 0.1 * busy_us / audio_us;
+    ol->since_up += frames;
+
+    stats_set(ol->stat_load, (long)(ol->load * 1000));
+    stats_set(ol->stat_backlog, backlog);
+
+    // more than 100 ms queued or too little headroom
+    if (ol->load > LOAD_HIGH || backlog > ol->rate / 10)
+    {
+        ol->over += frames;
+        ol->under = 0;
+
+        // sustained for 500 ms
+        if (ol->over >= ol->rate / 2 && ol->level < OVERLOAD_PASSTHROUGH)
+        {
+            // stepping down again soon after stepping up, wait longer next time
+            if (ol->since_up < ol->hold * 2 && ol->hold < ol->rate * HOLD_MAX_S)
+            {
+                ol->hold *= 2;
+            }
+            overload_set_level(ol, ol->level + 1, backlog);
+        }
+    }
+    else if (ol->load < LOAD_LOW && backlog < frames)
+    {
+        ol->under += frames;
+        ol->over = 0;
+
+        if (ol->under >= ol->hold && ol->level > OVERLOAD_FULL)
+        {
+            overload_set_level(ol, ol->level - 1, backlog);
+            ol->since_up = 0;
+        }
+    }
+    else
+    {
+        ol->over = 0;
+    }
+
+    // stable for a long time, forget past flapping
+    if (ol->since_up > ol->rate * HOLD_MAX_S * 2)
+    {
+        ol->hold = ol->rate * HOLD_MIN_S;
+        ol->since_up = ol->rate * HOLD_MAX_S;
+    }
+
+    return ol->level;
+}
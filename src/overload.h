@@ -0,0 +1,33 @@
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+// Processing levels, from full quality down to pass-through
+enum
+{
+    OVERLOAD_FULL = 0,      // full length echo filter
+    OVERLOAD_SHORT_FILTER,  // echo filter with half the taps
+    OVERLOAD_PASSTHROUGH,   // no echo cancellation
+    OVERLOAD_LEVELS
+};
+
+typedef struct _overload_t {
+    const char *name;       // pipeline name
+    unsigned rate;
+    int level;
+    double load;            // smoothed real-time factor, processing time / audio time
+    unsigned over;          // frames of audio processed while overloaded
+    unsigned under;         // frames of audio processed with headroom
+    unsigned hold;          // frames of headroom required before stepping up
+    unsigned since_up;      // frames since the last step up
+    unsigned transitions;
+    char stat_level[48];
+    char stat_transitions[48];
+    char stat_load[48];
+    char stat_backlog[48];
+} overload_t;
+
+void overload_init(overload_t *ol, unsigned rate, const char *name);
+int overload_update(overload_t *ol, double busy_us, unsigned frames, unsigned backlog);
+const char *overload_level_name(int level);
+
+#endif // _OVERLOAD_H_
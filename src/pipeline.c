@@ -0,0 +1,556 @@
+// pipeline.c - AEC processing of one mic array
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <speex/speex_echo.h>
+
+#include "arena.h"
+#include "audio.h"
+#include "conf.h"
+#include "echopath.h"
+#include "fifo.h"
+#include "graph.h"
+#include "kernels.h"
+#include "overload.h"
+#include "pipeline.h"
+#include "recorder.h"
+#include "stats.h"
+#include "subband.h"
+#include "tail.h"
+#include "trace.h"
+#include "util.h"
+
+#define IDLE_PERIOD_MS 5000     // without an output reader, the AEC runs on the first second of every period
+#define IDLE_ON_MS 1000
+#define IDLE_POLL_MS 100        // wait between drops of the rest of the period
+#define STANDBY_PERIOD_MS 8000  // the overload filter adapts on the first second of every period
+#define STANDBY_ON_MS 1000
+
+static void pipeline_aec(void *arg, void *ptr);
+static void pipeline_output(void *arg, void *ptr);
+
+static void frame_alloc(pipeline_t *p, pipeline_frame_t *frame, size_t samples)
+{
+    conf_t *conf = p->conf;
+
+    frame->rec_buf = (int16_t *)arena_alloc("frame buffers", samples * conf->rec_channels * sizeof(int16_t));
+    frame->far_buf = (int16_t *)arena_alloc("frame buffers", samples * conf->ref_channels * sizeof(int16_t));
+    frame->out = (int16_t *)arena_alloc("frame buffers", samples * conf->out_channels * sizeof(int16_t));
+    if (p->loopback)
+    {
+        frame->near_buf = (int16_t *)arena_alloc("frame buffers", samples * conf->out_channels * sizeof(int16_t));
+    }
+}
+
+// Without a loopback list, the reference is read from the playback ring buffer
+// and all recording channels are processed.
+void pipeline_init(pipeline_t *p, conf_t *conf, const int *mic_list, const int *loopback_list)
+{
+    memset(p, 0, sizeof(*p));
+    p->conf = conf;
+    p->loopback = loopback_list != NULL;
+    if (p->loopback)
+    {
+        memcpy(p->mic_list, mic_list, conf->out_channels * sizeof(int));
+        memcpy(p->loopback_list, loopback_list, conf->ref_channels * sizeof(int));
+    }
+
+    if (conf->frame_ms < 1 || conf->frame_ms > 64 || (conf->rate * conf->frame_ms) % 1000)
+    {
+        printf("Frame length %u ms is not supported at %u Hz\n", conf->frame_ms, conf->rate);
+        exit(1);
+    }
+
+    if (conf->max_batch < 1)
+    {
+        conf->max_batch = 1;
+    }
+
+    p->frame_size = conf->rate * conf->frame_ms / 1000;
+    printf("AEC frame size %d (%u ms)\n", p->frame_size, conf->frame_ms);
+
+    size_t samples = p->frame_size * conf->max_batch;
+    if (!conf->pipelined)
+    {
+        frame_alloc(p, &p->frame, samples);
+    }
+
+    // the echo canceller runs at the low band rate in sub-band mode
+    unsigned aec_rate = conf->rate;
+    int aec_filter_length = conf->filter_length;
+    p->aec_frame_size = p->frame_size;
+
+    if (conf->subband)
+    {
+        p->near_bands = subband_create(conf->rate, conf->out_channels);
+        p->far_bands = subband_create(conf->rate, conf->ref_channels);
+        p->out_bands = subband_create(conf->rate, conf->out_channels);
+
+        unsigned factor = conf->rate / SUBBAND_RATE;
+        aec_rate = SUBBAND_RATE;
+        p->aec_frame_size /= factor;
+        aec_filter_length /= factor;
+
+        p->near_low = (int16_t *)arena_alloc("frame buffers", samples / factor * conf->out_channels * sizeof(int16_t));
+        p->far_low = (int16_t *)arena_alloc("frame buffers", samples / factor * conf->ref_channels * sizeof(int16_t));
+        p->out_low = (int16_t *)arena_alloc("frame buffers", samples / factor * conf->out_channels * sizeof(int16_t));
+        p->high = (float *)arena_alloc("frame buffers", samples * conf->out_channels * sizeof(float));
+
+        printf("AEC on the low band at %u Hz, %d taps, suppression above\n", aec_rate, aec_filter_length);
+    }
+
+    // one echo state per filter length, created up front since nothing is allocated while running
+    tail_init(&p->tail, aec_rate, aec_filter_length, conf->name);
+    if (conf->fixed_length && p->tail.count > 2)
+    {
+        p->tail.count = 2;
+    }
+
+    // SpeexDSP allocates its state from the heap, measure it
+    size_t heap_used = arena_heap_used();
+
+    for (int i = 0; i < p->tail.count; i++)
+    {
+        p->echo_states[i] = speex_echo_state_init_mc(p->aec_frame_size,
+                                                     p->tail.lengths[i],
+                                                     conf->out_channels,
+                                                     conf->ref_channels);
+        speex_echo_ctl(p->echo_states[i], SPEEX_ECHO_SET_SAMPLING_RATE, &aec_rate);
+    }
+
+    arena_account("echo state", arena_heap_used() - heap_used);
+
+    if (!conf->fixed_length)
+    {
+        tail_alloc(&p->tail, p->echo_states[0]);
+        printf("Echo filter length %d taps, fitted to the echo tail down to %d\n",
+               p->tail.lengths[0], p->tail.lengths[p->tail.count > 1 ? p->tail.count - 2 : 0]);
+    }
+
+    echopath_init(&p->echopath, aec_rate, conf->name);
+    p->fast_out = (int16_t *)arena_alloc("frame buffers", p->aec_frame_size * conf->out_channels * sizeof(int16_t));
+    p->shadow_out = (int16_t *)arena_alloc("frame buffers", p->aec_frame_size * conf->out_channels * sizeof(int16_t));
+
+    overload_init(&p->overload, conf->rate, conf->name);
+    stats_name(p->stat_idle, sizeof(p->stat_idle), conf->name, "idle");
+
+    if (conf->recorder_seconds)
+    {
+        p->recorder = recorder_create(conf, conf->recorder_seconds);
+    }
+
+    // the caller reads the next batch while the previous ones are in the AEC and output stages
+    if (conf->pipelined)
+    {
+        void *frames[PIPELINE_FRAMES];
+        for (int i = 0; i < PIPELINE_FRAMES; i++)
+        {
+            frame_alloc(p, &p->frames[i], samples);
+            frames[i] = &p->frames[i];
+        }
+
+        p->graph = graph_create(frames, PIPELINE_FRAMES);
+        graph_add_stage(p->graph, "aec", pipeline_aec, p);
+        graph_add_stage(p->graph, "output", pipeline_output, p);
+        graph_start(p->graph);
+    }
+}
+
+// Cancel the echo of `batch` frames. After an echo path change the shortest filter, which
+// converges several times faster, is reset and runs alongside until the main one catches up,
+// and the output of whichever leaves less residual is used. A `shadow` filter, if any, adapts
+// on the same input without affecting the output, and the power of both outputs is summed up
+// in p->main_power and p->shadow_power.
+static void pipeline_cancel(pipeline_t *p, SpeexEchoState *state, SpeexEchoState *shadow,
+                            const int16_t *near, const int16_t *far, int16_t *out, int batch)
+{
+    conf_t *conf = p->conf;
+    int frame_size = p->aec_frame_size;
+    SpeexEchoState *fast = p->echo_states[p->tail.count - 1];
+
+    for (int i = 0; i < batch; i++)
+    {
+        const int16_t *n = near + i * frame_size * conf->out_channels;
+        const int16_t *f = far + i * frame_size * conf->ref_channels;
+        int16_t *o = out + i * frame_size * conf->out_channels;
+        int16_t *fast_out = NULL;
+
+        speex_echo_cancellation(state, n, f, o);
+
+        if (shadow)
+        {
+            speex_echo_cancellation(shadow, n, f, p->shadow_out);
+            p->main_power += kernel_energy_s16(o, frame_size * conf->out_channels);
+            p->shadow_power += kernel_energy_s16(p->shadow_out, frame_size * conf->out_channels);
+        }
+
+        if (p->echopath.recovering && fast != state)
+        {
+            fast_out = p->fast_out;
+            speex_echo_cancellation(fast, n, f, fast_out);
+        }
+
+        int action = echopath_update(&p->echopath, n, f, o, fast_out,
+                                     frame_size, conf->out_channels, conf->ref_channels);
+
+        if (fast_out)
+        {
+            double main_power = kernel_energy_s16(o, frame_size * conf->out_channels);
+            double fast_power = kernel_energy_s16(fast_out, frame_size * conf->out_channels);
+            if (fast_power < main_power)
+            {
+                memcpy(o, fast_out, frame_size * conf->out_channels * sizeof(int16_t));
+            }
+        }
+
+        if (action == ECHOPATH_START && fast != state)
+        {
+            speex_echo_state_reset(fast);
+        }
+        else if (action == ECHOPATH_RESET)
+        {
+            speex_echo_state_reset(state);
+        }
+    }
+}
+
+// Cancel echo on the decimated low band, and scale the high band by how much echo was
+// removed below, which costs far less than adaptive filtering at the full rate
+static void pipeline_subband(pipeline_t *p, SpeexEchoState *state, SpeexEchoState *shadow,
+                             pipeline_frame_t *frame)
+{
+    conf_t *conf = p->conf;
+    int batch = frame->batch;
+    int samples = frame->samples;
+    int low_frame_size = p->aec_frame_size;
+
+    subband_analysis(p->near_bands, frame->near, samples, p->near_low, p->high);
+    subband_analysis(p->far_bands, frame->far, samples, p->far_low, NULL);
+
+    pipeline_cancel(p, state, shadow, p->near_low, p->far_low, p->out_low, batch);
+
+    float gain = subband_suppression(p->near_bands, p->near_low, p->out_low,
+                                     low_frame_size * batch * conf->out_channels);
+    subband_synthesis(p->out_bands, p->out_low, p->high, gain, samples, frame->out);
+}
+
+// Read up to max_batch frames of the capture backlog and their reference into a frame.
+// Return the number of samples per channel read, 0 if no audio arrived within the timeout.
+static int pipeline_read(pipeline_t *p, pipeline_frame_t *frame, int timeout_ms)
+{
+    conf_t *conf = p->conf;
+    int frame_size = p->frame_size;
+
+    if (!p->loopback && conf->align)
+    {
+        audio_align(conf);
+    }
+
+    // after a stall, drain the backlog several frames per wakeup
+    int batch = capture_available(conf) / frame_size;
+    if (batch < 1)
+    {
+        batch = 1;
+    }
+    else if (batch > conf->max_batch)
+    {
+        batch = conf->max_batch;
+    }
+    int samples = frame_size * batch;
+
+    // in serial mode a mirrored ring hands the frames to the AEC in place, without a copy,
+    // and they are released once the output is written
+    frame->rec_in_place = p->graph == NULL && capture_mirrored(conf);
+    if (frame->rec_in_place)
+    {
+        frame->rec = (const int16_t *)capture_peek(conf, samples, timeout_ms);
+    }
+    else if (capture_read(conf, frame->rec_buf, samples, timeout_ms) == samples)
+    {
+        frame->rec = frame->rec_buf;
+    }
+    else
+    {
+        frame->rec = NULL;
+    }
+
+    // no audio while a capture device is being reopened
+    if (frame->rec == NULL)
+    {
+        return 0;
+    }
+
+    frame->far_in_place = 0;
+    if (p->loopback)
+    {
+        kernel_pick_s16(frame->near_buf, conf->out_channels, frame->rec, conf->rec_channels, p->mic_list, samples);
+        kernel_pick_s16(frame->far_buf, conf->ref_channels, frame->rec, conf->rec_channels, p->loopback_list, samples);
+        frame->near = frame->near_buf;
+        frame->far = frame->far_buf;
+    }
+    else
+    {
+        frame->near = frame->rec;
+        frame->far = NULL;
+        if (frame->rec_in_place && playback_mirrored(conf))
+        {
+            frame->far = (const int16_t *)playback_peek(conf, samples, timeout_ms);
+            frame->far_in_place = frame->far != NULL;
+            timeout_ms = 0;
+        }
+
+        // without enough reference, e.g. when playback has stopped, the rest is silence
+        if (frame->far == NULL)
+        {
+            playback_read(conf, frame->far_buf, samples, timeout_ms);
+            frame->far = frame->far_buf;
+        }
+    }
+
+    frame->batch = batch;
+    frame->samples = samples;
+
+    return samples;
+}
+
+static void pipeline_aec(void *arg, void *ptr)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+    pipeline_frame_t *frame = (pipeline_frame_t *)ptr;
+    conf_t *conf = p->conf;
+    int batch = frame->batch;
+    int samples = frame->samples;
+
+    double start = now_us();
+
+    TRACE_BEGIN("aec");
+    if (!conf->bypass && p->overload.level != OVERLOAD_PASSTHROUGH)
+    {
+        int index = p->tail.index;
+        if (p->overload.level != OVERLOAD_FULL && index + 1 < p->tail.count)
+        {
+            index++;
+        }
+        SpeexEchoState *state = p->echo_states[index];
+
+        // a resized filter runs alongside from scratch until it catches up, except while the
+        // fast filter is recovering from an echo path change or under load
+        SpeexEchoState *shadow = NULL;
+        tail_t *t = &p->tail;
+        if (t->candidate >= 0 && p->overload.level == OVERLOAD_FULL && !p->echopath.recovering)
+        {
+            shadow = p->echo_states[t->candidate];
+            // a shorter filter is the warm overload standby, a longer one has stale weights
+            if (t->trial_frames == 0 && t->candidate < t->index)
+            {
+                speex_echo_state_reset(shadow);
+            }
+        }
+        else if (p->overload.level == OVERLOAD_FULL && !p->echopath.recovering && index + 1 < t->count)
+        {
+            // keep the overload filter close to converged, so stepping down doesn't leak echo
+            if (p->standby_frames < t->rate * STANDBY_ON_MS / 1000)
+            {
+                shadow = p->echo_states[index + 1];
+            }
+            p->standby_frames += p->aec_frame_size * batch;
+            if (p->standby_frames >= t->rate * STANDBY_PERIOD_MS / 1000)
+            {
+                p->standby_frames = 0;
+            }
+        }
+
+        p->main_power = 0;
+        p->shadow_power = 0;
+        if (p->near_bands)
+        {
+            pipeline_subband(p, state, shadow, frame);
+        }
+        else
+        {
+            pipeline_cancel(p, state, shadow, frame->near, frame->far, frame->out, batch);
+        }
+
+        if (shadow && t->candidate >= 0)
+        {
+            tail_trial(t, p->main_power, p->shadow_power, p->aec_frame_size * batch);
+        }
+        else if (!conf->fixed_length && p->overload.level == OVERLOAD_FULL)
+        {
+            tail_update(t, state, p->aec_frame_size * batch);
+        }
+    }
+    else
+    {
+        memcpy(frame->out, frame->near, samples * conf->out_channels * conf->bits_per_sample / 8);
+    }
+
+    TRACE_END("aec");
+
+    // frames read in place are still in the capture ring until pipeline_release()
+    int backlog = capture_available(conf) - (frame->rec_in_place ? samples : 0);
+    overload_update(&p->overload, now_us() - start, samples, backlog);
+}
+
+static void pipeline_output(void *arg, void *ptr)
+{
+    pipeline_t *p = (pipeline_t *)arg;
+    pipeline_frame_t *frame = (pipeline_frame_t *)ptr;
+    conf_t *conf = p->conf;
+    int samples = frame->samples;
+
+    if (p->fp_rec)
+    {
+        fwrite(frame->rec, 2, samples * conf->rec_channels, p->fp_rec);
+    }
+    if (p->fp_far)
+    {
+        fwrite(frame->far, 2, samples * conf->ref_channels, p->fp_far);
+    }
+    if (p->fp_out)
+    {
+        fwrite(frame->out, 2, samples * conf->out_channels, p->fp_out);
+    }
+
+    if (p->recorder)
+    {
+        recorder_write(p->recorder, frame->rec, frame->far, frame->out, samples);
+    }
+
+    // the ring is cleared when a reader connects
+    if (fifo_connected(conf))
+    {
+        fifo_write(conf, frame->out, samples);
+    }
+}
+
+// Without an output reader, cancel echo on IDLE_ON_MS of every IDLE_PERIOD_MS of audio, so the
+// filter stays converged and the rings aligned, and drop the rest of the period unprocessed.
+// Never while the -s dump files are written, they would be chopped.
+// Return the number of samples per channel dropped, -1 when the next batch is to be processed.
+static int pipeline_idle(pipeline_t *p, int timeout_ms)
+{
+    conf_t *conf = p->conf;
+    unsigned on = conf->rate * IDLE_ON_MS / 1000;
+    unsigned period = conf->rate * IDLE_PERIOD_MS / 1000;
+
+    if (fifo_connected(conf) || p->fp_out)
+    {
+        if (p->idle)
+        {
+            p->idle = 0;
+            stats_set(p->stat_idle, 0);
+            printf("Output reader connected, process all audio\n");
+        }
+        return -1;
+    }
+
+    if (!p->idle)
+    {
+        p->idle = 1;
+        p->idle_frames = 0;
+        stats_set(p->stat_idle, 1);
+        printf("No output reader, process %u ms of every %u ms\n", IDLE_ON_MS, IDLE_PERIOD_MS);
+    }
+
+    if (p->idle_frames < on)
+    {
+        return -1;
+    }
+
+    // wake up less often, the capture ring holds the backlog until the next drop
+    unsigned left = period - p->idle_frames;
+    if (timeout_ms > 0 && (unsigned)capture_available(conf) < left)
+    {
+        TRACE_BEGIN("idle");
+        usleep(IDLE_POLL_MS * 1000);
+        TRACE_END("idle");
+    }
+
+    if (!p->loopback && conf->align)
+    {
+        audio_align(conf);
+    }
+
+    int dropped = audio_drop(conf, left);
+    p->idle_frames += dropped;
+    if (p->idle_frames >= period)
+    {
+        p->idle_frames = 0;
+    }
+
+    return dropped;
+}
+
+// Process up to max_batch frames of the capture backlog. In pipelined mode the frame is
+// only read here and handed to the AEC stage, which runs while the next one is read.
+// Return the number of samples per channel processed, 0 if no audio arrived within the timeout.
+int pipeline_process(pipeline_t *p, int timeout_ms)
+{
+    pipeline_frame_t *frame = &p->frame;
+
+    int dropped = pipeline_idle(p, timeout_ms);
+    if (dropped >= 0)
+    {
+        return dropped;
+    }
+
+    if (p->graph)
+    {
+        // all frames are in the stages when they fall behind
+        if (p->next == NULL)
+        {
+            TRACE_BEGIN("graph_wait");
+            p->next = (pipeline_frame_t *)graph_get(p->graph, timeout_ms);
+            TRACE_END("graph_wait");
+            if (p->next == NULL)
+            {
+                return 0;
+            }
+        }
+        frame = p->next;
+    }
+
+    int samples = pipeline_read(p, frame, timeout_ms);
+    if (samples == 0)
+    {
+        return 0;
+    }
+    p->idle_frames += p->idle ? samples : 0;
+
+    if (p->graph)
+    {
+        p->next = NULL;
+        graph_put(p->graph, frame);
+        return samples;
+    }
+
+    TRACE_BEGIN("process");
+    pipeline_aec(p, frame);
+    pipeline_output(p, frame);
+    TRACE_END("process");
+
+    if (frame->rec_in_place)
+    {
+        capture_release(p->conf, samples);
+    }
+    if (frame->far_in_place)
+    {
+        playback_release(p->conf, samples);
+    }
+
+    return samples;
+}
+
+// Stop the stage threads of pipelined mode, before the dump files are closed
+void pipeline_stop(pipeline_t *p)
+{
+    if (p->graph)
+    {
+        graph_stop(p->graph);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <speex/speex_echo.h>
+
+#include "conf.h"
+#include "echopath.h"
+#include "graph.h"
+#include "overload.h"
+#include "recorder.h"
+#include "subband.h"
+#include "tail.h"
+
+#define MAX_CHANNELS 32
+#define PIPELINE_STAGES 2               // AEC and output, after the read by the caller
+#define PIPELINE_FRAMES (PIPELINE_STAGES + 1)
+
+// A batch of frames on its way through the pipeline
+typedef struct
+{
+    int samples;                        // per channel
+    int batch;
+    const int16_t *rec;                 // the frame's own buffers, or frames in the rings when read in place
+    const int16_t *near;
+    const int16_t *far;
+    int16_t *out;
+    int16_t *rec_buf;
+    int16_t *near_buf;                  // loopback channels only
+    int16_t *far_buf;
+    int rec_in_place;                   // held in the capture ring until the output is written
+    int far_in_place;
+} pipeline_frame_t;
+
+// Echo cancellation of one mic array, from its capture ring buffer to its output FIFO
+typedef struct _pipeline_t {
+    conf_t *conf;
+    int loopback;                       // the reference is in loopback channels of the recording
+    int mic_list[MAX_CHANNELS];
+    int loopback_list[MAX_CHANNELS];
+    int frame_size;
+    int aec_frame_size;                 // at the low band rate in sub-band mode
+    SpeexEchoState *echo_states[TAIL_LENGTHS];  // by filter length, one shorter is used when overloaded
+    tail_t tail;
+    echopath_t echopath;
+    int16_t *fast_out;                  // of the shortest filter while recovering from an echo path change
+    int16_t *shadow_out;                // of a resized filter on trial, discarded
+    double main_power;                  // of the output and the shadow output of the last batch
+    double shadow_power;
+    unsigned standby_frames;            // into the current warm-up period of the overload filter
+    overload_t overload;
+    pipeline_frame_t frame;             // when processing in the caller thread
+    graph_t *graph;                     // pipelined mode, NULL otherwise
+    pipeline_frame_t frames[PIPELINE_FRAMES];
+    pipeline_frame_t *next;             // taken from the graph, not filled yet
+    FILE *fp_rec;
+    FILE *fp_far;
+    FILE *fp_out;
+    recorder_t *recorder;
+    subband_t *near_bands;              // sub-band mode, NULL otherwise
+    subband_t *far_bands;
+    subband_t *out_bands;
+    int16_t *near_low;
+    int16_t *far_low;
+    int16_t *out_low;
+    float *high;
+    int scheduled;                      // queued on or running in a worker pool
+    int idle;                           // nobody reads the output, see pipeline_idle()
+    unsigned idle_frames;               // into the current idle period
+    char stat_idle[48];
+} pipeline_t;
+
+void pipeline_init(pipeline_t *p, conf_t *conf, const int *mic_list, const int *loopback_list);
+int pipeline_process(pipeline_t *p, int timeout_ms);
+void pipeline_stop(pipeline_t *p);
+
+#endif // _PIPELINE_H_
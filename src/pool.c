@@ -0,0 +1,192 @@
+// pool.c - work-stealing thread pool
+//
+// Every worker owns a queue. A task is submitted to a preferred queue, so the
+// same pipeline tends to run on the same worker and keep its state in cache,
+// and an idle worker steals from the others when its own queue is empty.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "arena.h"
+#include "pool.h"
+#include "trace.h"
+
+#define POOL_MAX_WORKERS 32
+#define POOL_QUEUE_SIZE 64      // power of 2, more than the tasks that can be pending
+
+typedef struct
+{
+    void (*fn)(void *arg);
+    void *arg;
+} task_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned head;
+    unsigned tail;
+    task_t tasks[POOL_QUEUE_SIZE];
+} queue_t;
+
+typedef struct
+{
+    pool_t *pool;
+    int index;
+} worker_t;
+
+struct _pool_t
+{
+    int workers;
+    int quit;
+    int pending;                // tasks queued, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    queue_t queues[POOL_MAX_WORKERS];
+    pthread_t threads[POOL_MAX_WORKERS];
+    worker_t self[POOL_MAX_WORKERS];
+};
+
+static void queue_push(queue_t *q, void (*fn)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head >= POOL_QUEUE_SIZE)
+    {
+        printf("Task queue is full\n");
+        exit(1);
+    }
+    q->tasks[q->tail % POOL_QUEUE_SIZE].fn = fn;
+    q->tasks[q->tail % POOL_QUEUE_SIZE].arg = arg;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+// the owner takes the newest task, thieves the oldest
+static int queue_pop(queue_t *q, task_t *task, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != q->head)
+    {
+        if (steal)
+        {
+            *task = q->tasks[q->head % POOL_QUEUE_SIZE];
+            q->head++;
+        }
+        else
+        {
+            q->tail--;
+            *task = q->tasks[q->tail % POOL_QUEUE_SIZE];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+static void *worker(void *ptr)
+{
+    worker_t *self = (worker_t *)ptr;
+    pool_t *pool = self->pool;
+    task_t task;
+
+    trace_thread("worker");
+
+    while (1)
+    {
+        int found = queue_pop(&pool->queues[self->index], &task, 0);
+        for (int i = 1; !found && i < pool->workers; i++)
+        {
+            found = queue_pop(&pool->queues[(self->index + i) % pool->workers], &task, 1);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (found)
+        {
+            pool->pending--;
+        }
+        else
+        {
+            while (pool->pending <= 0 && !pool->quit)
+            {
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            }
+        }
+        int quit = pool->quit;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (found)
+        {
+            task.fn(task.arg);
+        }
+        else if (quit)
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+pool_t *pool_create(int workers)
+{
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+    else if (workers > POOL_MAX_WORKERS)
+    {
+        workers = POOL_MAX_WORKERS;
+    }
+
+    pool_t *pool = (pool_t *)arena_alloc("worker pool", sizeof(pool_t));
+    pool->workers = workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        pool->self[i].pool = pool;
+        pool->self[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, worker, &pool->self[i]))
+        {
+            printf("Fail to create worker thread\n");
+            exit(1);
+        }
+    }
+
+    printf("Worker pool with %d threads\n", workers);
+
+    return pool;
+}
+
+void pool_submit(pool_t *pool, int queue, void (*fn)(void *arg), void *arg)
+{
+    queue_push(&pool->queues[queue % pool->workers], fn, arg);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// queued tasks are run before the workers exit
+void pool_destroy(pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workers; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+typedef struct _pool_t pool_t;
+
+pool_t *pool_create(int workers);
+void pool_submit(pool_t *pool, int queue, void (*fn)(void *arg), void *arg);
+void pool_destroy(pool_t *pool);
+
+#endif // _POOL_H_
@@ -0,0 +1,284 @@
+// profile.c - host self-benchmark to pick the AEC settings
+//
+// The echo canceller is timed on synthetic audio with the channel layout and frame
+// length in use. Candidates are tried from the highest quality down: the longest filter
+// first, and at the same length full band before the cheaper sub-band mode at multiples
+// of 16 kHz. The first one whose cost fits the budget, in percent of one core, is used.
+// The choice is cached, so the benchmark runs once per host and layout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <speex/speex_echo.h>
+
+#include "arena.h"
+#include "conf.h"
+#include "profile.h"
+#include "subband.h"
+#include "tail.h"
+#include "util.h"
+
+#define PROFILE_WARMUP 20
+#define PROFILE_FRAMES 300
+#define PROFILE_LENGTHS 4           // requested filter length and 3 halvings
+#define PROFILE_MIN_LENGTH 256
+#define PROFILE_ARENA (4 * 1024 * 1024)    // for the filter banks, before the real arena is set up
+
+static void fill_noise(int16_t *buf, size_t samples, unsigned *seed)
+{
+    for (size_t i = 0; i < samples; i++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        buf[i] = (int16_t)((*seed >> 16) & 0x1FFF) - 0x1000;
+    }
+}
+
+// Return average microseconds per frame of the AEC as pipeline_aec() runs it at its peak:
+// the main filter of `filter_length` taps at the full rate, and one of half the taps
+// alongside. That is the overload standby while it warms up or is on trial as a shorter
+// length, and the filter in use while a grow to `filter_length` is on trial. The fast filter
+// after an echo path change is never longer. In sub-band mode both run on the low band, and
+// the near and far analysis and the synthesis are timed with them.
+static double profile_bench(conf_t *conf, int filter_length, int subband)
+{
+    unsigned factor = subband ? conf->rate / SUBBAND_RATE : 1;
+    unsigned rate = conf->rate / factor;
+    int frame_size = conf->rate * conf->frame_ms / 1000;
+    int aec_frame_size = frame_size / factor;
+    unsigned seed = 1;
+
+    int lengths[TAIL_LENGTHS];
+    int count = tail_lengths(rate, filter_length / factor, lengths);
+
+    int16_t *near = (int16_t *)calloc(frame_size * conf->out_channels, sizeof(int16_t));
+    int16_t *far = (int16_t *)calloc(frame_size * conf->ref_channels, sizeof(int16_t));
+    int16_t *out = (int16_t *)calloc(frame_size * conf->out_channels, sizeof(int16_t));
+    int16_t *near_low = (int16_t *)calloc(aec_frame_size * conf->out_channels, sizeof(int16_t));
+    int16_t *far_low = (int16_t *)calloc(aec_frame_size * conf->ref_channels, sizeof(int16_t));
+    int16_t *out_low = (int16_t *)calloc(aec_frame_size * conf->out_channels, sizeof(int16_t));
+    int16_t *second_out = (int16_t *)calloc(aec_frame_size * conf->out_channels, sizeof(int16_t));
+    float *high = (float *)calloc(frame_size * conf->out_channels, sizeof(float));
+
+    if (near == NULL || far == NULL || out == NULL || near_low == NULL || far_low == NULL ||
+        out_low == NULL || second_out == NULL || high == NULL)
+    {
+        printf("Fail to allocate memory\n");
+        exit(1);
+    }
+
+    // full band cancels in place
+    int16_t *aec_near = near, *aec_far = far, *aec_out = out;
+    subband_t *near_bands = NULL, *far_bands = NULL, *out_bands = NULL;
+    if (subband)
+    {
+        aec_near = near_low;
+        aec_far = far_low;
+        aec_out = out_low;
+        near_bands = subband_create(conf->rate, conf->out_channels);
+        far_bands = subband_create(conf->rate, conf->ref_channels);
+        out_bands = subband_create(conf->rate, conf->out_channels);
+    }
+
+    SpeexEchoState *echo_state = speex_echo_state_init_mc(aec_frame_size, lengths[0],
+                                                          conf->out_channels, conf->ref_channels);
+    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    SpeexEchoState *second_state = NULL;
+    if (count > 1)
+    {
+        second_state = speex_echo_state_init_mc(aec_frame_size, lengths[1],
+                                                conf->out_channels, conf->ref_channels);
+        speex_echo_ctl(second_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    }
+
+    double elapsed = 0;
+    for (int i = 0; i < PROFILE_WARMUP + PROFILE_FRAMES; i++)
+    {
+        fill_noise(near, frame_size * conf->out_channels, &seed);
+        fill_noise(far, frame_size * conf->ref_channels, &seed);
+
+        double start = now_us();
+        if (subband)
+        {
+            subband_analysis(near_bands, near, frame_size, near_low, high);
+            subband_analysis(far_bands, far, frame_size, far_low, NULL);
+        }
+
+        speex_echo_cancellation(echo_state, aec_near, aec_far, aec_out);
+        if (second_state)
+        {
+            speex_echo_cancellation(second_state, aec_near, aec_far, second_out);
+        }
+
+        if (subband)
+        {
+            float gain = subband_suppression(near_bands, near_low, out_low, aec_frame_size * conf->out_channels);
+            subband_synthesis(out_bands, out_low, high, gain, frame_size, out);
+        }
+        if (i >= PROFILE_WARMUP)
+        {
+            elapsed += now_us() - start;
+        }
+    }
+
+    speex_echo_state_destroy(echo_state);
+    if (second_state)
+    {
+        speex_echo_state_destroy(second_state);
+    }
+    free(near);
+    free(far);
+    free(out);
+    free(near_low);
+    free(far_low);
+    free(out_low);
+    free(second_out);
+    free(high);
+
+    return elapsed / PROFILE_FRAMES;
+}
+
+// the cache holds one "host rate out_channels ref_channels frame_ms filter_length subband
+// fixed_length budget chosen_length chosen_subband" line per host and layout
+static void profile_key(conf_t *conf, unsigned budget, char *key, size_t size)
+{
+    char host[64];
+
+    if (gethostname(host, sizeof(host)) != 0)
+    {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+
+    snprintf(key, size, "%s %u %u %u %u %u %u %u %u", host, conf->rate, conf->out_channels, conf->ref_channels,
+             conf->frame_ms, conf->filter_length, conf->subband, conf->fixed_length, budget);
+}
+
+static int profile_load(const char *path, const char *key, unsigned *filter_length, unsigned *subband)
+{
+    char line[256];
+    size_t len = strlen(key);
+    int found = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, key, len) == 0 && line[len] == ' ' &&
+            sscanf(line + len, "%u %u", filter_length, subband) == 2)
+        {
+            found = 1;
+        }
+    }
+    fclose(fp);
+
+    return found;
+}
+
+static int profile_save(const char *path, const char *key, unsigned filter_length, unsigned subband)
+{
+    char tmp[256];
+    char line[256];
+    size_t len = strlen(key);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "failed to write %s\n", tmp);
+        return -1;
+    }
+
+    // keep the other hosts and layouts
+    FILE *in = fopen(path, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            if (!(strncmp(line, key, len) == 0 && line[len] == ' '))
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %u %u\n", key, filter_length, subband);
+    fclose(out);
+
+    return rename(tmp, path);
+}
+
+// Set conf->filter_length and conf->subband to the best settings that cost at most
+// `budget` percent of one core, starting from the requested ones. Called before the
+// pipeline is created.
+void profile_select(conf_t *conf, unsigned budget, const char *path)
+{
+    char key[160];
+    unsigned filter_length = conf->filter_length;
+    unsigned subband = conf->subband;
+
+    profile_key(conf, budget, key, sizeof(key));
+    if (profile_load(path, key, &filter_length, &subband))
+    {
+        conf->filter_length = filter_length;
+        conf->subband = subband;
+        printf("Profile from %s: filter length %u, %s\n", path, filter_length, subband ? "sub-band" : "full band");
+        return;
+    }
+
+    // sub-band at the rates subband_create() takes, and full band is only tried when
+    // sub-band mode wasn't asked for
+    int can_subband = conf->rate % SUBBAND_RATE == 0 && conf->rate / SUBBAND_RATE >= 2;
+    int first_mode = conf->subband && can_subband ? 1 : 0;
+    int last_mode = can_subband ? 1 : 0;
+    double frame_us = conf->frame_ms * 1000.0;
+    double cost = 0;
+    int fits = 0;
+
+    printf("Benchmarking the echo canceller for a CPU budget of %u%%\n", budget);
+    arena_init(PROFILE_ARENA);
+
+    for (int i = 0; i < PROFILE_LENGTHS && !fits; i++)
+    {
+        unsigned length = conf->filter_length >> i;
+        if (i > 0 && length < PROFILE_MIN_LENGTH)
+        {
+            break;
+        }
+
+        for (int mode = first_mode; mode <= last_mode && !fits; mode++)
+        {
+            cost = profile_bench(conf, length, mode);
+
+            filter_length = length;
+            subband = mode;
+            fits = 100 * cost / frame_us <= budget;
+            printf("  filter length %5u, %-9s %8.1f us/frame, %5.1f%%\n",
+                   length, mode ? "sub-band" : "full band", cost, 100 * cost / frame_us);
+        }
+    }
+
+    arena_destroy();
+
+    if (!fits)
+    {
+        printf("Nothing fits the CPU budget, using the cheapest settings\n");
+    }
+
+    conf->filter_length = filter_length;
+    conf->subband = subband;
+    printf("Profile: filter length %u, %s, %.1f%% of a core\n",
+           filter_length, subband ? "sub-band" : "full band", 100 * cost / frame_us);
+
+    if (profile_save(path, key, filter_length, subband) < 0)
+    {
+        fprintf(stderr, "failed to cache the profile in %s\n", path);
+    }
+}
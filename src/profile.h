@@ -0,0 +1,10 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include "conf.h"
+
+// Pick the filter length and band mode that fit a CPU budget on this host, cached per host
+
+void profile_select(conf_t *conf, unsigned budget, const char *path);
+
+#endif // _PROFILE_H_
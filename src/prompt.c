@@ -0,0 +1,291 @@
+// prompt.c - prompts played from memory mapped files
+//
+// Every .wav or .raw file of a directory is mapped at startup and its pages are read in,
+// so starting a prompt costs no process, pipe or disk I/O. The control thread only posts
+// which prompt to start, and the playback thread mixes it into the frames it hands to the
+// device from the next transfer on. The AEC reference is copied from those frames, so the
+// echo of the prompt is cancelled like any other playback.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "conf.h"
+#include "control.h"
+#include "prompt.h"
+#include "stats.h"
+
+#define PROMPT_MAX 32
+#define PROMPT_STOP -1
+
+typedef struct
+{
+    char name[32];
+    const int16_t *samples;
+    unsigned frames;
+    unsigned channels;          // 1, mixed into every playback channel, or the playback channels
+} prompt_t;
+
+typedef struct _prompts_t
+{
+    prompt_t prompts[PROMPT_MAX];
+    int count;
+    unsigned channels;          // playback channels
+    int pending;                // posted by the control thread: prompt index + 1, PROMPT_STOP or 0
+    prompt_t *playing;
+    unsigned position;          // frames of the playing prompt mixed so far
+    char stat_played[48];
+} prompts_t;
+
+static uint32_t get_le(const uint8_t *p, int bytes)
+{
+    uint32_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// Find the samples of a 16 bit PCM WAV file. Return -1 if it isn't one.
+static int prompt_parse_wav(prompt_t *prompt, const uint8_t *data, size_t size, unsigned *rate)
+{
+    unsigned bits = 0;
+    size_t offset = 12;
+
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0)
+    {
+        return -1;
+    }
+
+    prompt->channels = 0;
+    while (offset + 8 <= size)
+    {
+        const uint8_t *chunk = data + offset;
+        size_t chunk_size = get_le(chunk + 4, 4);
+
+        offset += 8;
+        // truncated, or written as a stream with an unknown size
+        if (chunk_size > size - offset)
+        {
+            chunk_size = size - offset;
+        }
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16)
+        {
+            if (get_le(chunk + 8, 2) != 1)
+            {
+                return -1;
+            }
+            prompt->channels = get_le(chunk + 10, 2);
+            *rate = get_le(chunk + 12, 4);
+            bits = get_le(chunk + 22, 2);
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            if (bits != 16 || prompt->channels == 0)
+            {
+                return -1;
+            }
+            // chunks are word aligned, so are the samples
+            prompt->samples = (const int16_t *)(chunk + 8);
+            prompt->frames = chunk_size / (2 * prompt->channels);
+            return 0;
+        }
+
+        offset += chunk_size + (chunk_size & 1);
+    }
+
+    return -1;
+}
+
+// Map a prompt file and read its pages in. Return -1 if its format doesn't fit the playback.
+static int prompt_map(conf_t *conf, prompt_t *prompt, const char *path, int wav)
+{
+    struct stat st;
+    unsigned rate = conf->rate;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Fail to open prompt %s\n", path);
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("Fail to map prompt %s\n", path);
+        return -1;
+    }
+
+    // keep the pages in memory when it is allowed, so a prompt never waits for the disk
+    mlock(map, st.st_size);
+
+    if (wav)
+    {
+        if (prompt_parse_wav(prompt, map, st.st_size, &rate) < 0)
+        {
+            printf("%s is not a 16 bit PCM WAV file\n", path);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+    else
+    {
+        // raw prompts are in the playback format
+        prompt->channels = conf->ref_channels;
+        prompt->samples = (const int16_t *)map;
+        prompt->frames = st.st_size / (2 * prompt->channels);
+    }
+
+    if (rate != conf->rate || (prompt->channels != 1 && prompt->channels != conf->ref_channels))
+    {
+        printf("%s is %u Hz with %u channels, the playback is %u Hz with %u channels\n",
+               path, rate, prompt->channels, conf->rate, conf->ref_channels);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    return 0;
+}
+
+// `play {name}` starts a prompt, or restarts it, in place of the one playing
+static void prompt_play(void *arg, char *args)
+{
+    prompts_t *prompts = (prompts_t *)arg;
+
+    args[strcspn(args, " \t\r")] = '\0';
+    for (int i = 0; i < prompts->count; i++)
+    {
+        if (strcmp(prompts->prompts[i].name, args) == 0)
+        {
+            __atomic_store_n(&prompts->pending, i + 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    printf("Unknown prompt: %s\n", args);
+}
+
+// `stop` cuts the playing prompt short
+static void prompt_stop(void *arg, char *args)
+{
+    prompts_t *prompts = (prompts_t *)arg;
+
+    __atomic_store_n(&prompts->pending, PROMPT_STOP, __ATOMIC_RELEASE);
+}
+
+// Map the prompts of a directory and register the `play` and `stop` control commands.
+// Call before playback_start(). Return the number of prompts.
+int prompt_load(conf_t *conf, const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        fprintf(stderr, "Fail to open the prompt directory %s\n", dir);
+        exit(1);
+    }
+
+    prompts_t *prompts = arena_alloc("prompts", sizeof(prompts_t));
+    prompts->channels = conf->ref_channels;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        const char *ext = strrchr(entry->d_name, '.');
+        if (ext == NULL || (strcmp(ext, ".wav") != 0 && strcmp(ext, ".raw") != 0))
+        {
+            continue;
+        }
+        if (prompts->count >= PROMPT_MAX)
+        {
+            printf("Too many prompts, skip %s\n", entry->d_name);
+            continue;
+        }
+
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        prompt_t *prompt = &prompts->prompts[prompts->count];
+        if (prompt_map(conf, prompt, path, strcmp(ext, ".wav") == 0) == 0)
+        {
+            snprintf(prompt->name, sizeof(prompt->name), "%.*s", (int)(ext - entry->d_name), entry->d_name);
+            printf("prompt %s: %u ms\n", prompt->name, (unsigned)((uint64_t)prompt->frames * 1000 / conf->rate));
+            prompts->count++;
+        }
+    }
+    closedir(d);
+
+    stats_name(prompts->stat_played, sizeof(prompts->stat_played), conf->name, "prompts_played");
+    stats_set(prompts->stat_played, 0);
+
+    control_register("play", prompt_play, prompts);
+    control_register("stop", prompt_stop, prompts);
+    conf->prompts = prompts;
+
+    return prompts->count;
+}
+
+// Mix the playing prompt into `frames` frames of playback, starting a posted one at the
+// first frame. Called by the playback thread. Return the number of frames with prompt audio.
+unsigned prompt_mix(prompts_t *prompts, int16_t *buf, unsigned frames)
+{
+    int pending = __atomic_exchange_n(&prompts->pending, 0, __ATOMIC_ACQUIRE);
+    if (pending == PROMPT_STOP)
+    {
+        prompts->playing = NULL;
+    }
+    else if (pending > 0)
+    {
+        prompts->playing = &prompts->prompts[pending - 1];
+        prompts->position = 0;
+        stats_add(prompts->stat_played, 1);
+    }
+
+    prompt_t *prompt = prompts->playing;
+    if (prompt == NULL)
+    {
+        return 0;
+    }
+
+    unsigned channels = prompts->channels;
+    unsigned count = prompt->frames - prompts->position;
+    if (count > frames)
+    {
+        count = frames;
+    }
+
+    const int16_t *src = prompt->samples + (size_t)prompts->position * prompt->channels;
+    for (unsigned i = 0; i < count; i++)
+    {
+        for (unsigned c = 0; c < channels; c++)
+        {
+            int s = buf[i * channels + c] + src[prompt->channels == 1 ? i : i * channels + c];
+            buf[i * channels + c] = s > INT16_MAX ? INT16_MAX : (s < INT16_MIN ? INT16_MIN : s);
+        }
+    }
+
+    prompts->position += count;
+    if (prompts->position >= prompt->frames)
+    {
+        prompts->playing = NULL;
+    }
+
+    return count;
+}
@@ -0,0 +1,16 @@
+#ifndef _PROMPT_H_
+#define _PROMPT_H_
+
+#include <stdint.h>
+
+#include "conf.h"
+
+// Short sounds such as earcons or cached TTS, memory mapped at startup and mixed into the
+// playback on `play {name}`, so they also reach the AEC reference
+
+struct _prompts_t;
+
+int prompt_load(conf_t *conf, const char *dir);
+unsigned prompt_mix(struct _prompts_t *prompts, int16_t *buf, unsigned frames);
+
+#endif // _PROMPT_H_
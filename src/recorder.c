@@ -0,0 +1,231 @@
+// recorder.c - in-memory flight recorder
+//
+// The processing thread copies every batch into three rings, one per stream, and
+// publishes the number of frames written. A dump thread copies the rings out while
+// they keep being written: it starts a little after the oldest frame and gives up
+// if the writer laps it, so the processing thread never waits and never does I/O.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "arena.h"
+#include "conf.h"
+#include "recorder.h"
+#include "stats.h"
+
+#define RECORDER_MAX 16
+#define RECORDER_CHUNK 1024     // frames copied out per step of a dump
+#define RECORDER_CHANNELS 96
+
+struct _recorder_t
+{
+    conf_t *conf;
+    size_t capacity;            // frames
+    int16_t *rec;
+    int16_t *far;
+    int16_t *out;
+    size_t written;             // frames written since start, published by the writer
+    char stat_dumps[48];
+};
+
+static recorder_t *g_recorders[RECORDER_MAX];
+static int g_recorder_count = 0;
+static sem_t g_dump_sem;
+static pthread_t g_dump_thread;
+
+recorder_t *recorder_create(conf_t *conf, unsigned seconds)
+{
+    if (g_recorder_count >= RECORDER_MAX)
+    {
+        fprintf(stderr, "Too many flight recorders\n");
+        exit(1);
+    }
+
+    if (conf->rec_channels + conf->ref_channels + conf->out_channels > RECORDER_CHANNELS)
+    {
+        fprintf(stderr, "Too many channels for the flight recorder\n");
+        exit(1);
+    }
+
+    recorder_t *r = (recorder_t *)arena_alloc("flight recorder", sizeof(recorder_t));
+    r->conf = conf;
+    r->capacity = (size_t)conf->rate * seconds;
+    r->rec = (int16_t *)arena_alloc("flight recorder", r->capacity * conf->rec_channels * sizeof(int16_t));
+    r->far = (int16_t *)arena_alloc("flight recorder", r->capacity * conf->ref_channels * sizeof(int16_t));
+    r->out = (int16_t *)arena_alloc("flight recorder", r->capacity * conf->out_channels * sizeof(int16_t));
+    stats_name(r->stat_dumps, sizeof(r->stat_dumps), conf->name, "recorder_dumps");
+
+    g_recorders[g_recorder_count++] = r;
+
+    return r;
+}
+
+static void ring_copy(int16_t *ring, size_t capacity, unsigned channels, size_t pos, const int16_t *buf, size_t frames)
+{
+    size_t offset = pos % capacity;
+    size_t first = frames < capacity - offset ? frames : capacity - offset;
+
+    memcpy(ring + offset * channels, buf, first * channels * sizeof(int16_t));
+    memcpy(ring, buf + first * channels, (frames - first) * channels * sizeof(int16_t));
+}
+
+// called by the processing thread only
+void recorder_write(recorder_t *r, const int16_t *rec, const int16_t *far, const int16_t *out, size_t frames)
+{
+    conf_t *conf = r->conf;
+    size_t pos = r->written;
+
+    // keep the newest frames of a batch longer than the recorder
+    if (frames > r->capacity)
+    {
+        pos += frames - r->capacity;
+        rec += (frames - r->capacity) * conf->rec_channels;
+        far += (frames - r->capacity) * conf->ref_channels;
+        out += (frames - r->capacity) * conf->out_channels;
+        frames = r->capacity;
+    }
+
+    ring_copy(r->rec, r->capacity, conf->rec_channels, pos, rec, frames);
+    ring_copy(r->far, r->capacity, conf->ref_channels, pos, far, frames);
+    ring_copy(r->out, r->capacity, conf->out_channels, pos, out, frames);
+
+    __atomic_store_n(&r->written, pos + frames, __ATOMIC_RELEASE);
+}
+
+static void put_le(uint8_t *p, uint32_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static void wav_header(uint8_t *h, unsigned rate, unsigned channels, size_t frames)
+{
+    uint32_t data_bytes = frames * channels * 2;
+
+    memcpy(h, "RIFF", 4);
+    put_le(h + 4, 36 + data_bytes, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_le(h + 16, 16, 4);
+    put_le(h + 20, 1, 2);                   // PCM
+    put_le(h + 22, channels, 2);
+    put_le(h + 24, rate, 4);
+    put_le(h + 28, rate * channels * 2, 4);
+    put_le(h + 32, channels * 2, 2);
+    put_le(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    put_le(h + 40, data_bytes, 4);
+}
+
+// One WAV file, each sample holds the capture, then the reference, then the output channels,
+// so the three streams are aligned sample by sample
+static int recorder_dump(recorder_t *r)
+{
+    static int16_t buf[RECORDER_CHUNK * RECORDER_CHANNELS];
+    conf_t *conf = r->conf;
+    unsigned channels = conf->rec_channels + conf->ref_channels + conf->out_channels;
+    char path[256];
+    uint8_t header[44];
+
+    size_t batch = conf->rate * conf->frame_ms / 1000 * conf->max_batch;
+    size_t end = __atomic_load_n(&r->written, __ATOMIC_ACQUIRE);
+    // leave the writer a head start of 1/8 of the recorder before it catches up with the dump
+    size_t margin = r->capacity / 8;
+    size_t start = end > r->capacity - margin ? end - (r->capacity - margin) : 0;
+
+    snprintf(path, sizeof(path), "/tmp/%s%srecorder-%ld.wav",
+             conf->name ? conf->name : "", conf->name ? "-" : "", (long)time(NULL));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "failed to open %s\n", path);
+        return -1;
+    }
+
+    wav_header(header, conf->rate, channels, end - start);
+    int ok = write(fd, header, sizeof(header)) == sizeof(header);
+
+    for (size_t pos = start; ok && pos < end; pos += RECORDER_CHUNK)
+    {
+        size_t frames = end - pos < RECORDER_CHUNK ? end - pos : RECORDER_CHUNK;
+
+        for (size_t i = 0; i < frames; i++)
+        {
+            size_t offset = (pos + i) % r->capacity;
+            int16_t *dst = buf + i * channels;
+
+            memcpy(dst, r->rec + offset * conf->rec_channels, conf->rec_channels * sizeof(int16_t));
+            dst += conf->rec_channels;
+            memcpy(dst, r->far + offset * conf->ref_channels, conf->ref_channels * sizeof(int16_t));
+            dst += conf->ref_channels;
+            memcpy(dst, r->out + offset * conf->out_channels, conf->out_channels * sizeof(int16_t));
+        }
+
+        // the chunk is valid only if the writer, including a batch not published yet,
+        // has not wrapped around onto it meanwhile. The fence keeps the copies above
+        // from moving after the load, as an acquire load alone doesn't
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->written, __ATOMIC_RELAXED) + batch > pos + r->capacity)
+        {
+            fprintf(stderr, "flight recorder was overwritten while dumping %s\n", path);
+            ok = 0;
+            break;
+        }
+
+        ok = write(fd, buf, frames * channels * sizeof(int16_t)) == (ssize_t)(frames * channels * sizeof(int16_t));
+    }
+
+    close(fd);
+
+    if (ok)
+    {
+        printf("Dumped %.1f s of audio to %s (%u capture, %u reference, %u output channels)\n",
+               (double)(end - start) / conf->rate, path,
+               conf->rec_channels, conf->ref_channels, conf->out_channels);
+        stats_add(r->stat_dumps, 1);
+    }
+
+    return ok ? 0 : -1;
+}
+
+static void *dump_thread(void *ptr)
+{
+    while (1)
+    {
+        if (sem_wait(&g_dump_sem) != 0)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < g_recorder_count; i++)
+        {
+            recorder_dump(g_recorders[i]);
+        }
+    }
+
+    return NULL;
+}
+
+int recorder_start(void)
+{
+    sem_init(&g_dump_sem, 0, 0);
+    pthread_create(&g_dump_thread, NULL, dump_thread, NULL);
+    pthread_detach(g_dump_thread);
+
+    return 0;
+}
+
+// async-signal-safe, dumps all recorders
+void recorder_trigger(void)
+{
+    sem_post(&g_dump_sem);
+}
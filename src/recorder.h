@@ -0,0 +1,19 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conf.h"
+
+// Flight recorder: the last seconds of capture, reference and output audio, kept in memory
+// and dumped to a WAV file on demand
+
+typedef struct _recorder_t recorder_t;
+
+recorder_t *recorder_create(conf_t *conf, unsigned seconds);
+void recorder_write(recorder_t *r, const int16_t *rec, const int16_t *far, const int16_t *out, size_t frames);
+int recorder_start(void);
+void recorder_trigger(void);
+
+#endif // _RECORDER_H_
@@ -0,0 +1,42 @@
+// ring.c - ring buffers mapped twice back to back where the size allows
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "ring.h"
+
+// Allocate the buffer of `count` frames from the arena and initialize the ring.
+// Return 1 if the buffer is mirrored, 0 if a window may wrap.
+int ring_init(PaUtilRingBuffer *ring, const char *name, ring_buffer_size_t element_bytes,
+              ring_buffer_size_t count)
+{
+    size_t size = (size_t)element_bytes * count;
+    void *buf = arena_alloc_mirrored(name, size);
+    int mirrored = buf != NULL;
+
+    if (!mirrored)
+    {
+        buf = arena_alloc(name, size);
+    }
+
+    if (PaUtil_InitializeRingBuffer(ring, element_bytes, count, buf) == -1)
+    {
+        fprintf(stderr, "Initialize ring buffer but element count is not a power of 2.\n");
+        exit(1);
+    }
+
+    return mirrored;
+}
+
+// Point at up to `frames` readable frames in one piece, without moving the read index.
+// A mirrored ring has all of them in one piece, otherwise the window stops at the wrap.
+ring_buffer_size_t ring_read_window(PaUtilRingBuffer *ring, int mirrored, ring_buffer_size_t frames, void **data)
+{
+    void *data2;
+    ring_buffer_size_t size1, size2;
+
+    PaUtil_GetRingBufferReadRegions(ring, frames, data, &size1, &data2, &size2);
+
+    return mirrored ? size1 + size2 : size1;
+}
@@ -0,0 +1,16 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "pa_ringbuffer.h"
+
+// Ring buffers of audio frames. Where the size in bytes is a multiple of the page size the
+// buffer is mapped twice back to back, so any window of the ring is contiguous and the frames
+// are handed to SpeexDSP or write() straight from the ring.
+
+#define RING_SLACK_MS 100   // thread stalls and alignment corrections a ring rides out when sized to fit
+
+int ring_init(PaUtilRingBuffer *ring, const char *name, ring_buffer_size_t element_bytes,
+              ring_buffer_size_t count);
+ring_buffer_size_t ring_read_window(PaUtilRingBuffer *ring, int mirrored, ring_buffer_size_t frames, void **data);
+
+#endif // _RING_H_
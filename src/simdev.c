@@ -0,0 +1,502 @@
+// simdev.c - simulated audio devices
+//
+// Backends whose transfers are paced by a simulated clock, like a sound card running
+// at the sample rate: a device has as many frames to transfer as the clock has passed,
+// and with no descriptors to poll, ready_us() tells when to come back. The threads and
+// the event loop run them as they run ALSA PCMs. The loopback device keeps a history
+// of played frames, and capture mixes it back through the echo path taps.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "arena.h"
+#include "backend.h"
+#include "simdev.h"
+#include "util.h"
+
+#define SIMDEV_MAX_TAPS 8
+#define SIMDEV_WRITE_AHEAD 2048     // frames a playback device buffers ahead of its clock
+#define SIMDEV_HISTORY 65536        // played frames kept by the loopback, power of 2
+#define SIMDEV_CHUNK 256            // frames a device waits for before a transfer
+
+typedef struct
+{
+    unsigned rate;
+    unsigned channels;              // played channels
+    int taps;
+    unsigned delay[SIMDEV_MAX_TAPS];
+    float gain[SIMDEV_MAX_TAPS];
+    int near_fd;                    // near-end talker, mono raw S16_LE, -1 if none
+    int16_t *history;               // played frames, mixed to mono
+    size_t played;                  // frames written to history, published by the playback thread
+} loop_t;
+
+typedef struct
+{
+    int playback;
+    unsigned rate;
+    unsigned channels;
+    size_t position;                // frames transferred
+    int fd;
+    int eof;
+    loop_t *loop;
+} simdev_t;
+
+static const backend_ops_t g_null_ops;
+static const backend_ops_t g_file_ops;
+static const backend_ops_t g_loop_ops;
+
+static double g_speed = 1;
+static int64_t g_start_us = 0;      // set by the first device to look at the clock
+static loop_t *g_loop = NULL;       // one loopback per process, shared by its two sides
+
+// the backend of a simulated device, NULL if the name is an ALSA PCM
+const backend_ops_t *simdev_ops(const char *name)
+{
+    if (strncmp(name, "null", 4) == 0)
+    {
+        return &g_null_ops;
+    }
+    if (strncmp(name, "file:", 5) == 0)
+    {
+        return &g_file_ops;
+    }
+    if (strncmp(name, "loop", 4) == 0)
+    {
+        return &g_loop_ops;
+    }
+
+    return NULL;
+}
+
+int simdev_match(const char *name)
+{
+    return simdev_ops(name) != NULL;
+}
+
+// parse "echo=800:0.5:1400:0.2"
+static void parse_echo(loop_t *loop, char *value)
+{
+    loop->taps = 0;
+    for (char *s = strtok(value, ":"); s != NULL && loop->taps < SIMDEV_MAX_TAPS; s = strtok(NULL, ":"))
+    {
+        char *gain = strtok(NULL, ":");
+        unsigned delay = atoi(s);
+        if (gain == NULL || delay >= SIMDEV_HISTORY - SIMDEV_WRITE_AHEAD * 4)
+        {
+            fprintf(stderr, "invalid echo path, use echo=DELAY:GAIN[:DELAY:GAIN...]\n");
+            exit(1);
+        }
+        loop->delay[loop->taps] = delay;
+        loop->gain[loop->taps] = atof(gain);
+        loop->taps++;
+    }
+}
+
+static simdev_t *simdev_open(const char *name, int playback, unsigned rate, unsigned channels)
+{
+    enum { SPEED, ECHO, NEAR };
+    char *const keys[] = { "speed", "echo", "near", NULL };
+    char *value;
+    char *near = NULL;
+    char *echo = NULL;
+
+    simdev_t *dev = (simdev_t *)arena_alloc("simulated devices", sizeof(simdev_t));
+    dev->playback = playback;
+    dev->rate = rate;
+    dev->channels = channels;
+    dev->fd = -1;
+
+    // options follow the first comma
+    size_t len = strlen(name);
+    char *spec = (char *)arena_alloc("simulated devices", len + 1);
+    memcpy(spec, name, len + 1);
+    char *options = strchr(spec, ',');
+    if (options)
+    {
+        *options++ = '\0';
+        while (*options != '\0')
+        {
+            switch (getsubopt(&options, keys, &value))
+            {
+            case SPEED:
+                if (value && atof(value) > 0)
+                {
+                    g_speed = atof(value);
+                }
+                break;
+            case ECHO:
+                echo = value;
+                break;
+            case NEAR:
+                near = value;
+                break;
+            default:
+                fprintf(stderr, "unknown option %s of device %s\n", value, spec);
+                exit(1);
+            }
+        }
+    }
+
+    if (strncmp(spec, "file:", 5) == 0)
+    {
+        dev->fd = playback ? open(spec + 5, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(spec + 5, O_RDONLY);
+        if (dev->fd < 0)
+        {
+            fprintf(stderr, "failed to open %s\n", spec + 5);
+            exit(1);
+        }
+    }
+    else if (strncmp(spec, "loop", 4) == 0)
+    {
+        if (g_loop == NULL)
+        {
+            g_loop = (loop_t *)arena_alloc("simulated devices", sizeof(loop_t));
+            g_loop->history = (int16_t *)arena_alloc("simulated devices", SIMDEV_HISTORY * sizeof(int16_t));
+            g_loop->rate = rate;
+            g_loop->channels = 1;
+            g_loop->near_fd = -1;
+            g_loop->taps = 2;
+            g_loop->delay[0] = rate / 20;       // direct path, 50 ms
+            g_loop->gain[0] = 0.5;
+            g_loop->delay[1] = rate / 10;       // a reflection
+            g_loop->gain[1] = 0.2;
+        }
+        if (echo)
+        {
+            parse_echo(g_loop, echo);
+        }
+        if (near)
+        {
+            g_loop->near_fd = open(near, O_RDONLY);
+            if (g_loop->near_fd < 0)
+            {
+                fprintf(stderr, "failed to open %s\n", near);
+                exit(1);
+            }
+        }
+        if (playback)
+        {
+            g_loop->channels = channels;
+        }
+        dev->loop = g_loop;
+    }
+
+    printf("simulated %s device %s, %u channels, clock x%.1f\n",
+           playback ? "playback" : "capture", spec, channels, g_speed);
+
+    return dev;
+}
+
+// wall clock time when the simulated clock started, the first device to ask starts it
+static int64_t simdev_start_us(void)
+{
+    int64_t start = __atomic_load_n(&g_start_us, __ATOMIC_ACQUIRE);
+    if (start == 0)
+    {
+        int64_t expected = 0;
+        start = (int64_t)now_us();
+        if (!__atomic_compare_exchange_n(&g_start_us, &expected, start, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            start = expected;
+        }
+    }
+
+    return start;
+}
+
+// frames the simulated clock has passed
+static size_t simdev_clock(simdev_t *dev)
+{
+    double elapsed = now_us() - simdev_start_us();
+
+    return elapsed > 0 ? (size_t)(elapsed * dev->rate * g_speed / 1000000) : 0;
+}
+
+// position the clock has to reach before a transfer of `frames` frames
+static size_t simdev_position(simdev_t *dev, size_t frames)
+{
+    if (dev->playback)
+    {
+        return dev->position + frames > SIMDEV_WRITE_AHEAD ? dev->position + frames - SIMDEV_WRITE_AHEAD : 0;
+    }
+
+    return dev->position + frames;
+}
+
+static void loop_capture(simdev_t *dev, int16_t *buf, size_t frames)
+{
+    loop_t *loop = dev->loop;
+    size_t played = __atomic_load_n(&loop->played, __ATOMIC_ACQUIRE);
+    int16_t near[256];
+
+    for (size_t i = 0; i < frames; i++)
+    {
+        size_t position = dev->position + i;
+        float sample = 0;
+
+        for (int t = 0; t < loop->taps; t++)
+        {
+            // frames not played in time, or already overwritten, are silence
+            if (position >= loop->delay[t] && position - loop->delay[t] < played &&
+                played - (position - loop->delay[t]) <= SIMDEV_HISTORY)
+            {
+                sample += loop->gain[t] * loop->history[(position - loop->delay[t]) & (SIMDEV_HISTORY - 1)];
+            }
+        }
+
+        if (loop->near_fd >= 0)
+        {
+            if (i % 256 == 0)
+            {
+                size_t count = frames - i < 256 ? frames - i : 256;
+                int r = read(loop->near_fd, near, count * sizeof(int16_t));
+                memset((char *)near + (r > 0 ? r : 0), 0, count * sizeof(int16_t) - (r > 0 ? r : 0));
+            }
+            sample += near[i % 256];
+        }
+
+        if (sample > 32767)
+        {
+            sample = 32767;
+        }
+        else if (sample < -32768)
+        {
+            sample = -32768;
+        }
+        for (unsigned ch = 0; ch < dev->channels; ch++)
+        {
+            buf[i * dev->channels + ch] = (int16_t)sample;
+        }
+    }
+}
+
+static void loop_playback(simdev_t *dev, const int16_t *buf, size_t frames)
+{
+    loop_t *loop = dev->loop;
+    size_t played = loop->played;
+
+    for (size_t i = 0; i < frames; i++)
+    {
+        int sum = 0;
+        for (unsigned ch = 0; ch < dev->channels; ch++)
+        {
+            sum += buf[i * dev->channels + ch];
+        }
+        loop->history[(played + i) & (SIMDEV_HISTORY - 1)] = sum / (int)dev->channels;
+    }
+
+    __atomic_store_n(&loop->played, played + frames, __ATOMIC_RELEASE);
+}
+
+static int simdev_init(backend_t *dev)
+{
+    dev->state = simdev_open(dev->name, dev->playback, dev->rate, dev->channels);
+
+    return 0;
+}
+
+// nothing to open or close, the device lives as long as the process
+static int simdev_nop(backend_t *dev)
+{
+    return 0;
+}
+
+static void simdev_close(backend_t *dev)
+{
+}
+
+static int simdev_poll_fds(backend_t *dev, struct pollfd *pfds, int space)
+{
+    return 0;
+}
+
+// microseconds until a chunk is due
+static int64_t simdev_ready_us(backend_t *dev)
+{
+    simdev_t *sim = (simdev_t *)dev->state;
+    double due = simdev_start_us() + simdev_position(sim, SIMDEV_CHUNK) * 1000000.0 / (sim->rate * g_speed);
+    double wait = due - now_us();
+
+    return wait > 0 ? (int64_t)wait : 0;
+}
+
+static unsigned short simdev_revents(backend_t *dev, struct pollfd *pfds, int nfds)
+{
+    if (simdev_ready_us(dev) > 0)
+    {
+        return 0;
+    }
+
+    return dev->playback ? POLLOUT : POLLIN;
+}
+
+// frames captured by the clock and not read yet, or room left ahead of it to play
+static long simdev_avail(backend_t *dev)
+{
+    simdev_t *sim = (simdev_t *)dev->state;
+    size_t clock = simdev_clock(sim);
+
+    if (sim->playback)
+    {
+        return clock + SIMDEV_WRITE_AHEAD > sim->position ? clock + SIMDEV_WRITE_AHEAD - sim->position : 0;
+    }
+
+    return clock > sim->position ? clock - sim->position : 0;
+}
+
+// Simulated time of the next frame to transfer. Capture and playback on the same
+// clock compare directly, like the PCM delays of real devices.
+static int simdev_delay(backend_t *dev, int64_t *time_us, long *frames)
+{
+    simdev_t *sim = (simdev_t *)dev->state;
+    long clock = simdev_clock(sim);
+
+    *time_us = (int64_t)(sim->position * 1000000.0 / sim->rate);
+    *frames = sim->playback ? (long)sim->position - clock : clock - (long)sim->position;
+
+    return 0;
+}
+
+static int simdev_recover(backend_t *dev, int err)
+{
+    return err;
+}
+
+// the area of a transfer is the chunk buffer
+static long simdev_area(backend_t *dev, char **area, unsigned long frames)
+{
+    *area = dev->chunk;
+
+    return frames < dev->chunk_size ? frames : dev->chunk_size;
+}
+
+static long simdev_advance(backend_t *dev, unsigned long frames)
+{
+    ((simdev_t *)dev->state)->position += frames;
+
+    return frames;
+}
+
+// silence in, playback discarded
+static long null_begin(backend_t *dev, char **area, unsigned long frames)
+{
+    frames = simdev_area(dev, area, frames);
+    if (!dev->playback)
+    {
+        memset(*area, 0, frames * dev->channels * sizeof(int16_t));
+    }
+
+    return frames;
+}
+
+// read the captured frames from the file, silence after its end
+static long file_begin(backend_t *dev, char **area, unsigned long frames)
+{
+    simdev_t *sim = (simdev_t *)dev->state;
+
+    frames = simdev_area(dev, area, frames);
+    if (dev->playback)
+    {
+        return frames;
+    }
+
+    size_t bytes = frames * dev->channels * sizeof(int16_t);
+    size_t done = 0;
+    while (!sim->eof && done < bytes)
+    {
+        int r = read(sim->fd, *area + done, bytes - done);
+        if (r <= 0)
+        {
+            printf("end of capture file\n");
+            sim->eof = 1;
+            break;
+        }
+        done += r;
+    }
+    memset(*area + done, 0, bytes - done);
+
+    return frames;
+}
+
+static long file_commit(backend_t *dev, unsigned long frames)
+{
+    simdev_t *sim = (simdev_t *)dev->state;
+
+    if (dev->playback && write(sim->fd, dev->chunk, frames * dev->channels * sizeof(int16_t)) < 0)
+    {
+        fprintf(stderr, "failed to write playback file\n");
+    }
+
+    return simdev_advance(dev, frames);
+}
+
+static long loop_begin(backend_t *dev, char **area, unsigned long frames)
+{
+    frames = simdev_area(dev, area, frames);
+    if (!dev->playback)
+    {
+        loop_capture((simdev_t *)dev->state, (int16_t *)*area, frames);
+    }
+
+    return frames;
+}
+
+static long loop_commit(backend_t *dev, unsigned long frames)
+{
+    if (dev->playback)
+    {
+        loop_playback((simdev_t *)dev->state, (const int16_t *)dev->chunk, frames);
+    }
+
+    return simdev_advance(dev, frames);
+}
+
+static const backend_ops_t g_null_ops = {
+    .init = simdev_init,
+    .open = simdev_nop,
+    .close = simdev_close,
+    .start = simdev_nop,
+    .poll_fds = simdev_poll_fds,
+    .revents = simdev_revents,
+    .ready_us = simdev_ready_us,
+    .avail = simdev_avail,
+    .delay = simdev_delay,
+    .begin = null_begin,
+    .commit = simdev_advance,
+    .recover = simdev_recover,
+};
+
+static const backend_ops_t g_file_ops = {
+    .init = simdev_init,
+    .open = simdev_nop,
+    .close = simdev_close,
+    .start = simdev_nop,
+    .poll_fds = simdev_poll_fds,
+    .revents = simdev_revents,
+    .ready_us = simdev_ready_us,
+    .avail = simdev_avail,
+    .delay = simdev_delay,
+    .begin = file_begin,
+    .commit = file_commit,
+    .recover = simdev_recover,
+};
+
+static const backend_ops_t g_loop_ops = {
+    .init = simdev_init,
+    .open = simdev_nop,
+    .close = simdev_close,
+    .start = simdev_nop,
+    .poll_fds = simdev_poll_fds,
+    .revents = simdev_revents,
+    .ready_us = simdev_ready_us,
+    .avail = simdev_avail,
+    .delay = simdev_delay,
+    .begin = loop_begin,
+    .commit = loop_commit,
+    .recover = simdev_recover,
+};
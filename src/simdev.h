@@ -0,0 +1,17 @@
+#ifndef _SIMDEV_H_
+#define _SIMDEV_H_
+
+#include "backend.h"
+
+// Audio devices that need no sound card, selected by PCM name instead of ALSA:
+//  null[,speed=N]                      silence in, audio out discarded
+//  file:PATH[,speed=N]                 raw S16_LE in from PATH, or out to PATH
+//  loop[,echo=D:G:D:G,near=PATH,speed=N]
+//                                      capture hears playback through an echo path of
+//                                      delays D (frames) and gains G, plus near-end audio
+// All simulated devices share one clock, which runs N times faster than real time.
+
+int simdev_match(const char *name);
+const backend_ops_t *simdev_ops(const char *name);
+
+#endif // _SIMDEV_H_
@@ -0,0 +1,241 @@
+// soak.c - long runs at accelerated time, summarized for comparison between builds
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "conf.h"
+#include "simdev.h"
+#include "soak.h"
+#include "stats.h"
+#include "util.h"
+
+#define SOAK_RSS_WARMUP_S 60    // memory allocated while starting up is not growth
+
+// ring buffer levels and alignment, sampled every second of audio
+static const char *gauge_names[] = {
+    "capture_backlog",
+    "out_backlog_frames",
+    "playback_delay_frames",
+    "capture_delay_frames",
+    "align_error_frames",
+    "load_permille"
+};
+
+// glitches and transitions, counted over the run
+static const char *counter_names[] = {
+    "capture_lost_frames",
+    "playback_underruns",
+    "capture_reopens",
+    "playback_reopens",
+    "align_corrections",
+    "bypass_transitions",
+    "overload_transitions",
+    "filter_resizes",
+    "out_dropped_oldest_frames",
+    "out_dropped_newest_frames",
+    "out_dropped_block_frames",
+    "out_gaps"
+};
+
+#define GAUGES (sizeof(gauge_names) / sizeof(gauge_names[0]))
+#define COUNTERS (sizeof(counter_names) / sizeof(counter_names[0]))
+
+typedef struct
+{
+    unsigned seconds;           // of audio processed
+    unsigned duration;
+    double start_us;            // wall clock
+    double start_cpu_us;
+    long start_switches[2];     // voluntary, involuntary
+    long rss_start_kb;
+    long rss_max_kb;
+    long rss_kb;
+    char gauges[GAUGES][48];
+    long gauge_min[GAUGES];
+    long gauge_max[GAUGES];
+    char counters[COUNTERS][48];
+    long counter_start[COUNTERS];
+} soak_t;
+
+static soak_t g_soak;
+
+static double cpu_us(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// context switches of all threads, voluntary ones are mostly waits for audio or a lock
+static void switches(long count[2])
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    count[0] = usage.ru_nvcsw;
+    count[1] = usage.ru_nivcsw;
+}
+
+// no stdio, so nothing is allocated while running
+static long rss_kb(void)
+{
+    char buf[128];
+    long size = 0, resident = 0;
+
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    int len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+    {
+        return 0;
+    }
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void soak_init(conf_t *conf, unsigned hours)
+{
+    soak_t *soak = &g_soak;
+
+    memset(soak, 0, sizeof(*soak));
+    soak->duration = hours * 3600;
+    soak->start_us = now_us();
+    soak->start_cpu_us = cpu_us();
+    switches(soak->start_switches);
+
+    for (unsigned i = 0; i < GAUGES; i++)
+    {
+        stats_name(soak->gauges[i], sizeof(soak->gauges[i]), conf->name, gauge_names[i]);
+        soak->gauge_min[i] = -1;
+    }
+
+    for (unsigned i = 0; i < COUNTERS; i++)
+    {
+        stats_name(soak->counters[i], sizeof(soak->counters[i]), conf->name, counter_names[i]);
+        soak->counter_start[i] = stats_get(soak->counters[i]);
+    }
+
+    if (!simdev_match(conf->rec_pcm))
+    {
+        printf("Soak test on %s runs in real time, use a simulated device with speed= to accelerate it\n", conf->rec_pcm);
+    }
+
+    printf("Soak test for %u hours of audio\n", hours);
+}
+
+// Sample once per second of audio. Return 1 when the run is over.
+int soak_tick(void)
+{
+    soak_t *soak = &g_soak;
+
+    soak->seconds++;
+
+    for (unsigned i = 0; i < GAUGES; i++)
+    {
+        long value = stats_get(soak->gauges[i]);
+        if (soak->gauge_min[i] < 0 || value < soak->gauge_min[i])
+        {
+            soak->gauge_min[i] = value;
+        }
+        if (value > soak->gauge_max[i])
+        {
+            soak->gauge_max[i] = value;
+        }
+    }
+
+    if (soak->seconds % 60 == 0)
+    {
+        soak->rss_kb = rss_kb();
+        if (soak->seconds == SOAK_RSS_WARMUP_S)
+        {
+            soak->rss_start_kb = soak->rss_kb;
+        }
+        if (soak->rss_kb > soak->rss_max_kb)
+        {
+            soak->rss_max_kb = soak->rss_kb;
+        }
+    }
+
+    if (soak->seconds % 3600 == 0)
+    {
+        double wall = (now_us() - soak->start_us) / 1e6;
+        printf("soak %u/%u h: x%.1f real time, cpu %.2f%%, rss %ld kB, capture backlog max %ld, lost frames %ld\n",
+               soak->seconds / 3600, soak->duration / 3600, soak->seconds / wall,
+               100 * (cpu_us() - soak->start_cpu_us) / (soak->seconds * 1e6), soak->rss_kb,
+               soak->gauge_max[0], stats_get(soak->counters[0]) - soak->counter_start[0]);
+    }
+
+    return soak->seconds >= soak->duration;
+}
+
+// Print the summary and write it to `path` as "name value" lines, like the stats file,
+// so runs of two builds can be compared with diff
+void soak_report(const char *path)
+{
+    soak_t *soak = &g_soak;
+    char buf[4096];
+    int len = 0;
+
+    double wall = (now_us() - soak->start_us) / 1e6;
+    double cpu = (cpu_us() - soak->start_cpu_us) / 1e6;
+    long count[2];
+    switches(count);
+    if (soak->seconds == 0)
+    {
+        soak->seconds = 1;
+    }
+
+    len += snprintf(buf + len, sizeof(buf) - len, "audio_seconds %u\n", soak->seconds);
+    len += snprintf(buf + len, sizeof(buf) - len, "wall_seconds %.0f\n", wall);
+    len += snprintf(buf + len, sizeof(buf) - len, "cpu_seconds %.1f\n", cpu);
+    len += snprintf(buf + len, sizeof(buf) - len, "cpu_permille_of_audio %.1f\n", 1000 * cpu / soak->seconds);
+    len += snprintf(buf + len, sizeof(buf) - len, "voluntary_switches_per_second %.1f\n",
+                    (double)(count[0] - soak->start_switches[0]) / soak->seconds);
+    len += snprintf(buf + len, sizeof(buf) - len, "involuntary_switches_per_second %.1f\n",
+                    (double)(count[1] - soak->start_switches[1]) / soak->seconds);
+    len += snprintf(buf + len, sizeof(buf) - len, "rss_start_kb %ld\n", soak->rss_start_kb);
+    len += snprintf(buf + len, sizeof(buf) - len, "rss_max_kb %ld\n", soak->rss_max_kb);
+    len += snprintf(buf + len, sizeof(buf) - len, "rss_end_kb %ld\n", soak->rss_kb);
+    len += snprintf(buf + len, sizeof(buf) - len, "rss_growth_kb %ld\n",
+                    soak->rss_start_kb ? soak->rss_kb - soak->rss_start_kb : 0);
+
+    for (unsigned i = 0; i < GAUGES; i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s_min %ld\n%s_max %ld\n",
+                        soak->gauges[i], soak->gauge_min[i] < 0 ? 0 : soak->gauge_min[i],
+                        soak->gauges[i], soak->gauge_max[i]);
+    }
+
+    for (unsigned i = 0; i < COUNTERS; i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s %ld\n",
+                        soak->counters[i], stats_get(soak->counters[i]) - soak->counter_start[i]);
+    }
+
+    printf("Soak test summary:\n%s", buf);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        printf("Fail to write %s\n", path);
+        return;
+    }
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+    printf("Soak test summary written to %s\n", path);
+}
@@ -0,0 +1,13 @@
+#ifndef _SOAK_H_
+#define _SOAK_H_
+
+#include "conf.h"
+
+// Soak test: run the whole pipeline for hours of audio, usually on simulated devices with
+// an accelerated clock, and summarize CPU, memory, ring buffer extremes and glitches
+
+void soak_init(conf_t *conf, unsigned hours);
+int soak_tick(void);
+void soak_report(const char *path);
+
+#endif // _SOAK_H_
@@ -0,0 +1,133 @@
+// stats.c
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+#define STATS_MAX 256
+
+#define STATS_NAME_SIZE 48
+
+typedef struct
+{
+    char name[STATS_NAME_SIZE];
+    long value;
+} stat_t;
+
+static stat_t g_stats[STATS_MAX];
+static int g_stats_count = 0;
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// names are registered on first use and never removed
+static stat_t *stats_find(const char *name)
+{
+    int count = __atomic_load_n(&g_stats_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(g_stats[i].name, name) == 0)
+        {
+            return &g_stats[i];
+        }
+    }
+
+    pthread_mutex_lock(&g_stats_lock);
+    stat_t *stat = NULL;
+    for (int i = 0; i < g_stats_count; i++)
+    {
+        if (strcmp(g_stats[i].name, name) == 0)
+        {
+            stat = &g_stats[i];
+            break;
+        }
+    }
+    if (stat == NULL && g_stats_count < STATS_MAX)
+    {
+        stat = &g_stats[g_stats_count];
+        snprintf(stat->name, sizeof(stat->name), "%s", name);
+        stat->value = 0;
+        __atomic_store_n(&g_stats_count, g_stats_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+
+    return stat;
+}
+
+// Name a metric of one pipeline, e.g. "a1_capture_lost_frames". No prefix for a single pipeline.
+const char *stats_name(char *buf, size_t size, const char *prefix, const char *name)
+{
+    if (prefix == NULL || prefix[0] == '\0')
+    {
+        snprintf(buf, size, "%s", name);
+    }
+    else
+    {
+        snprintf(buf, size, "%s_%s", prefix, name);
+    }
+
+    return buf;
+}
+
+void stats_set(const char *name, long value)
+{
+    stat_t *stat = stats_find(name);
+    if (stat)
+    {
+        __atomic_store_n(&stat->value, value, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_add(const char *name, long value)
+{
+    stat_t *stat = stats_find(name);
+    if (stat)
+    {
+        __atomic_fetch_add(&stat->value, value, __ATOMIC_RELAXED);
+    }
+}
+
+long stats_get(const char *name)
+{
+    stat_t *stat = stats_find(name);
+
+    return stat ? __atomic_load_n(&stat->value, __ATOMIC_RELAXED) : 0;
+}
+
+// write to a temporary file and rename it, so readers never see a partial file.
+// No stdio, so nothing is allocated while running.
+int stats_write(const char *path)
+{
+    char tmp[256];
+    char buf[STATS_MAX * 64];
+    int len = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int count = __atomic_load_n(&g_stats_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && len < (int)sizeof(buf); i++)
+    {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s %ld\n",
+                        g_stats[i].name, __atomic_load_n(&g_stats[i].value, __ATOMIC_RELAXED));
+    }
+    if (len > (int)sizeof(buf))
+    {
+        len = sizeof(buf);
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int written = write(fd, buf, len);
+    close(fd);
+    if (written != len)
+    {
+        return -1;
+    }
+
+    return rename(tmp, path);
+}
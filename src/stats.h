@@ -0,0 +1,14 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+
+// Named counters and gauges, written to a text file as "name value" lines
+
+const char *stats_name(char *buf, size_t size, const char *prefix, const char *name);
+void stats_set(const char *name, long value);
+void stats_add(const char *name, long value);
+long stats_get(const char *name);
+int stats_write(const char *path);
+
+#endif // _STATS_H_
@@ -0,0 +1,191 @@
+// subband.c - two band polyphase filter bank
+//
+// The low band is a windowed-sinc lowpass of the input, decimated by rate / 16000.
+// The high band is the input minus that lowpass, delayed to match, so with a high
+// band gain of 1 and an untouched low band the output is the input, delayed.
+// Decimation and interpolation only compute the polyphase terms that are used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "arena.h"
+#include "kernels.h"
+#include "subband.h"
+
+#define SUBBAND_TAPS_PER_PHASE 48
+#define SUBBAND_CUTOFF 7000.0       // Hz, below the 8 kHz Nyquist of the low band
+#define SUBBAND_GAIN_MIN 0.05f
+#define SUBBAND_GAIN_RELEASE 0.05f  // per frame, the gain drops at once and recovers slowly
+
+struct _subband_t
+{
+    unsigned factor;
+    unsigned channels;
+    unsigned taps;                  // odd, the delay is (taps - 1) / 2
+    float *coef;
+    float *phase_coef;              // coef split into `factor` phases of phase_taps, zero padded
+    unsigned phase_taps;
+    float *line;                    // per channel input history, newest first, twice taps long
+    unsigned pos;
+    float *high_line;               // per channel high band history, for the synthesis delay
+    unsigned high_pos;
+    float gain;
+};
+
+static inline int16_t clamp16(float v)
+{
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : (int16_t)lrintf(v));
+}
+
+subband_t *subband_create(unsigned rate, unsigned channels)
+{
+    if (rate % SUBBAND_RATE || rate / SUBBAND_RATE < 2)
+    {
+        printf("Sub-band processing needs a multiple of %u Hz, not %u Hz\n", SUBBAND_RATE, rate);
+        exit(1);
+    }
+
+    subband_t *sb = (subband_t *)arena_alloc("sub-band filters", sizeof(subband_t));
+    sb->factor = rate / SUBBAND_RATE;
+    sb->channels = channels;
+    sb->taps = SUBBAND_TAPS_PER_PHASE * sb->factor + 1;
+    sb->coef = (float *)arena_alloc("sub-band filters", sb->taps * sizeof(float));
+    sb->phase_taps = (sb->taps + sb->factor - 1) / sb->factor;
+    sb->phase_coef = (float *)arena_alloc("sub-band filters", sb->factor * sb->phase_taps * sizeof(float));
+    sb->line = (float *)arena_alloc("sub-band filters", 2 * sb->taps * channels * sizeof(float));
+    sb->high_line = (float *)arena_alloc("sub-band filters", 2 * sb->taps * channels * sizeof(float));
+    sb->gain = 1;
+
+    // Blackman windowed sinc, unity gain at DC
+    double fc = SUBBAND_CUTOFF / rate;
+    double sum = 0;
+    int mid = (sb->taps - 1) / 2;
+    for (int k = 0; k < (int)sb->taps; k++)
+    {
+        double x = k - mid;
+        double sinc = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * cos(2 * M_PI * k / (sb->taps - 1)) + 0.08 * cos(4 * M_PI * k / (sb->taps - 1));
+        sb->coef[k] = sinc * window;
+        sum += sb->coef[k];
+    }
+    for (unsigned k = 0; k < sb->taps; k++)
+    {
+        sb->coef[k] /= sum;
+    }
+
+    // contiguous per phase for the interpolation dot products
+    memset(sb->phase_coef, 0, sb->factor * sb->phase_taps * sizeof(float));
+    for (unsigned k = 0; k < sb->taps; k++)
+    {
+        sb->phase_coef[(k % sb->factor) * sb->phase_taps + k / sb->factor] = sb->coef[k];
+    }
+
+    return sb;
+}
+
+// push a sample to a history of `taps` samples, kept twice so the newest is followed by the rest
+static inline float *line_push(float *line, unsigned taps, unsigned pos, float v)
+{
+    line[pos] = v;
+    line[pos + taps] = v;
+    return line + pos;
+}
+
+// `frames` full band frames in, frames / factor low band frames out,
+// and the high band, `frames` frames, when `high` isn't NULL
+void subband_analysis(subband_t *sb, const int16_t *in, size_t frames, int16_t *low, float *high)
+{
+    unsigned taps = sb->taps;
+    unsigned delay = (taps - 1) / 2;
+
+    for (size_t n = 0; n < frames; n++)
+    {
+        unsigned pos = sb->pos;
+        sb->pos = pos == 0 ? taps - 1 : pos - 1;
+        int decimate = n % sb->factor == 0;
+
+        for (unsigned ch = 0; ch < sb->channels; ch++)
+        {
+            float *x = line_push(sb->line + ch * 2 * taps, taps, pos, in[n * sb->channels + ch]);
+            if (!decimate && high == NULL)
+            {
+                continue;
+            }
+
+            float lp = kernel_dot_f32(sb->coef, x, taps);
+
+            if (decimate)
+            {
+                low[(n / sb->factor) * sb->channels + ch] = clamp16(lp);
+            }
+            if (high)
+            {
+                high[n * sb->channels + ch] = x[delay] - lp;
+            }
+        }
+    }
+}
+
+// Interpolate the low band back to the full rate and add the high band scaled by `high_gain`
+void subband_synthesis(subband_t *sb, const int16_t *low, const float *high, float high_gain,
+                       size_t frames, int16_t *out)
+{
+    unsigned taps = sb->taps;
+    unsigned factor = sb->factor;
+    unsigned phase_taps = sb->phase_taps;
+    unsigned delay = (taps - 1) / 2;
+
+    for (size_t m = 0; m < frames / factor; m++)
+    {
+        // low band history, at the low rate
+        unsigned pos = sb->pos;
+        sb->pos = pos == 0 ? taps - 1 : pos - 1;
+
+        for (unsigned ch = 0; ch < sb->channels; ch++)
+        {
+            float *x = line_push(sb->line + ch * 2 * taps, taps, pos, low[m * sb->channels + ch]);
+
+            for (unsigned p = 0; p < factor; p++)
+            {
+                size_t n = m * factor + p;
+                float up = kernel_dot_f32(sb->phase_coef + p * phase_taps, x, phase_taps);
+
+                // the interpolated low band lags the analysis by another filter delay
+                float *h = sb->high_line + ch * 2 * taps;
+                unsigned hpos = (sb->high_pos + p) % taps;
+                h[hpos] = high[n * sb->channels + ch];
+                float delayed = h[(hpos + taps - delay) % taps];
+
+                out[n * sb->channels + ch] = clamp16(up * factor + high_gain * delayed);
+            }
+        }
+        sb->high_pos = (sb->high_pos + factor) % taps;
+    }
+}
+
+// High band gain from how much the echo canceller removed from the low band
+float subband_suppression(subband_t *sb, const int16_t *near_low, const int16_t *out_low, size_t samples)
+{
+    double near = 1 + kernel_energy_s16(near_low, samples);
+    double out = 1 + kernel_energy_s16(out_low, samples);
+
+    float gain = out < near ? sqrtf(out / near) : 1;
+    if (gain < SUBBAND_GAIN_MIN)
+    {
+        gain = SUBBAND_GAIN_MIN;
+    }
+
+    if (gain < sb->gain)
+    {
+        sb->gain = gain;
+    }
+    else
+    {
+        sb->gain += SUBBAND_GAIN_RELEASE * (gain - sb->gain);
+    }
+
+    return sb->gain;
+}
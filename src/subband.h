@@ -0,0 +1,20 @@
+#ifndef _SUBBAND_H_
+#define _SUBBAND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Split full band audio into a low band decimated to SUBBAND_RATE and the rest at the
+// full rate, and put them back together. The echo canceller then runs on the low band.
+
+#define SUBBAND_RATE 16000
+
+typedef struct _subband_t subband_t;
+
+subband_t *subband_create(unsigned rate, unsigned channels);
+void subband_analysis(subband_t *sb, const int16_t *in, size_t frames, int16_t *low, float *high);
+void subband_synthesis(subband_t *sb, const int16_t *low, const float *high, float high_gain,
+                       size_t frames, int16_t *out);
+float subband_suppression(subband_t *sb, const int16_t *near_low, const int16_t *out_low, size_t samples);
+
+#endif // _SUBBAND_H_
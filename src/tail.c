@@ -0,0 +1,247 @@
+// tail.c - fit the echo filter length to the measured echo tail
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+#include "tail.h"
+
+#define TAIL_MIN_MS 32          // shortest filter
+#define TAIL_CHECK_S 2          // read the impulse response this often
+#define TAIL_SETTLE_S 10        // let a resized filter converge before judging it
+#define TAIL_SHRINK_VOTES 3     // consecutive checks before shrinking
+#define TAIL_GROW_VOTES 2       // consecutive checks before growing
+#define TAIL_DECAY 1e-4         // tail ends 40 dB below the peak
+#define TAIL_FLOOR 4.0          // or 6 dB above the misadjustment noise of the weights
+#define TAIL_PEAK_MIN 1024.0    // 32 per tap, -60 dB, no echo learnt yet
+#define TAIL_TRIAL_S 30         // drop a resize whose filter hasn't caught up by then
+#define TAIL_MATCH 1.12         // it takes over within 0.5 dB of the residual echo of the current one
+
+// Fill `lengths` with filter_length and its halvings down to TAIL_MIN_MS, return how many
+int tail_lengths(unsigned rate, int filter_length, int *lengths)
+{
+    int count = 1;
+
+    lengths[0] = filter_length;
+    while (count < TAIL_LENGTHS && (filter_length >> count) >= (int)(rate * TAIL_MIN_MS / 1000))
+    {
+        lengths[count] = filter_length >> count;
+        count++;
+    }
+
+    return count;
+}
+
+void tail_init(tail_t *t, unsigned rate, int filter_length, const char *name)
+{
+    memset(t, 0, sizeof(*t));
+    t->name = name ? name : "";
+    t->rate = rate;
+    t->candidate = -1;
+    t->count = tail_lengths(rate, filter_length, t->lengths);
+
+    stats_name(t->stat_tail, sizeof(t->stat_tail), name, "echo_tail_ms");
+    stats_name(t->stat_length, sizeof(t->stat_length), name, "filter_length");
+    stats_name(t->stat_resizes, sizeof(t->stat_resizes), name, "filter_resizes");
+
+    stats_set(t->stat_length, filter_length);
+    stats_set(t->stat_resizes, 0);
+}
+
+// allocate the impulse response of the longest filter
+void tail_alloc(tail_t *t, SpeexEchoState *state)
+{
+    int size = 0;
+    speex_echo_ctl(state, SPEEX_ECHO_GET_IMPULSE_RESPONSE_SIZE, &size);
+    t->response = (int32_t *)arena_alloc("echo tail", size * sizeof(int32_t));
+    t->response_size = size;
+}
+
+// Return the taps up to the end of the echo in the impulse response, 0 if there is no echo yet.
+// The weights of taps past the echo only hold misadjustment noise, whose level is taken from the
+// quietest fifth of the response.
+static int tail_estimate(tail_t *t, int size)
+{
+    int block = t->rate / 1000;
+    int blocks = size / block;
+    if (blocks < 5)
+    {
+        return 0;
+    }
+
+    double energy[blocks];
+    double sorted[blocks];
+    double peak = 0;
+    for (int b = 0; b < blocks; b++)
+    {
+        double sum = 0;
+        for (int i = b * block; i < (b + 1) * block; i++)
+        {
+            sum += (double)t->response[i] * t->response[i];
+        }
+        energy[b] = sum / block;
+        if (energy[b] > peak)
+        {
+            peak = energy[b];
+        }
+    }
+
+    if (peak < TAIL_PEAK_MIN * TAIL_PEAK_MIN)
+    {
+        return 0;
+    }
+
+    // partial selection sort, only the quietest fifth is needed
+    memcpy(sorted, energy, sizeof(sorted));
+    int quiet = blocks / 5;
+    for (int i = 0; i <= quiet; i++)
+    {
+        for (int j = i + 1; j < blocks; j++)
+        {
+            if (sorted[j] < sorted[i])
+            {
+                double tmp = sorted[i];
+                sorted[i] = sorted[j];
+                sorted[j] = tmp;
+            }
+        }
+    }
+
+    double threshold = peak * TAIL_DECAY;
+    if (sorted[quiet] * TAIL_FLOOR > threshold)
+    {
+        threshold = sorted[quiet] * TAIL_FLOOR;
+    }
+
+    int last = 0;
+    for (int b = 0; b < blocks; b++)
+    {
+        if (energy[b] > threshold)
+        {
+            last = b;
+        }
+    }
+
+    return (last + 1) * block;
+}
+
+// Account `frames` frames processed by `state`, the filter in use at full quality.
+// Return the index of the filter length to use from now on.
+int tail_update(tail_t *t, SpeexEchoState *state, unsigned frames)
+{
+    t->elapsed += frames;
+    t->since_resize += frames;
+    // a resize on trial is judged by tail_trial()
+    if (t->elapsed < t->rate * TAIL_CHECK_S || t->count < 2 || t->candidate >= 0)
+    {
+        return t->index;
+    }
+    t->elapsed = 0;
+
+    int size = 0;
+    speex_echo_ctl(state, SPEEX_ECHO_GET_IMPULSE_RESPONSE_SIZE, &size);
+    if (size > t->response_size)
+    {
+        size = t->response_size;
+    }
+    speex_echo_ctl(state, SPEEX_ECHO_GET_IMPULSE_RESPONSE, t->response);
+
+    int tail = tail_estimate(t, size);
+    if (tail == 0)
+    {
+        t->votes = 0;
+        return t->index;
+    }
+    t->tail = tail;
+    stats_set(t->stat_tail, (long)tail * 1000 / t->rate);
+
+    if (t->since_resize < t->rate * TAIL_SETTLE_S)
+    {
+        return t->index;
+    }
+
+    // grow when the echo reaches the last quarter of the filter, and shrink only when it fits
+    // in half of the shorter one, so a tail between the two doesn't flip the length back and forth
+    int length = t->lengths[t->index];
+    int index = t->index;
+    if (tail > length * 3 / 4 && t->index > 0)
+    {
+        t->votes = t->votes > 0 ? t->votes + 1 : 1;
+        if (t->votes >= TAIL_GROW_VOTES)
+        {
+            index = t->index - 1;
+        }
+    }
+    else if (t->index + 2 < t->count && tail <= t->lengths[t->index + 1] / 2)
+    {
+        t->votes = t->votes < 0 ? t->votes - 1 : -1;
+        if (-t->votes >= TAIL_SHRINK_VOTES)
+        {
+            index = t->index + 1;
+        }
+    }
+    else
+    {
+        t->votes = 0;
+    }
+
+    // the new length runs alongside from scratch, the current one stays in use until it catches up
+    if (index != t->index)
+    {
+        printf("Echo tail%s%s %d ms: try filter length %d -> %d\n",
+               t->name[0] ? " " : "", t->name, tail * 1000 / (int)t->rate, length, t->lengths[index]);
+
+        t->candidate = index;
+        t->votes = 0;
+        t->trial_frames = 0;
+        t->trial_elapsed = 0;
+        t->current_power = 0;
+        t->candidate_power = 0;
+    }
+
+    return t->index;
+}
+
+// Account `frames` frames cancelled by both the current and the candidate filter, with the
+// power of their outputs. Every TAIL_CHECK_S seconds the candidate takes over if it leaves
+// as little residual echo, and it is dropped if it hasn't within TAIL_TRIAL_S seconds.
+void tail_trial(tail_t *t, double current_power, double candidate_power, unsigned frames)
+{
+    t->trial_frames += frames;
+    t->trial_elapsed += frames;
+    t->current_power += current_power;
+    t->candidate_power += candidate_power;
+    if (t->trial_elapsed < t->rate * TAIL_CHECK_S)
+    {
+        return;
+    }
+
+    int length = t->lengths[t->index];
+    if (t->candidate_power <= t->current_power * TAIL_MATCH)
+    {
+        printf("Echo tail%s%s: filter length %d -> %d\n",
+               t->name[0] ? " " : "", t->name, length, t->lengths[t->candidate]);
+
+        t->index = t->candidate;
+        t->candidate = -1;
+        t->since_resize = 0;
+        t->resizes++;
+
+        stats_set(t->stat_length, t->lengths[t->index]);
+        stats_set(t->stat_resizes, t->resizes);
+    }
+    else if (t->trial_frames >= t->rate * TAIL_TRIAL_S)
+    {
+        printf("Echo tail%s%s: keep filter length %d, %d didn't catch up\n",
+               t->name[0] ? " " : "", t->name, length, t->lengths[t->candidate]);
+
+        t->candidate = -1;
+        t->since_resize = 0;
+    }
+
+    t->trial_elapsed = 0;
+    t->current_power = 0;
+    t->candidate_power = 0;
+}
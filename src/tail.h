@@ -0,0 +1,40 @@
+#ifndef _TAIL_H_
+#define _TAIL_H_
+
+#include <stdint.h>
+
+#include <speex/speex_echo.h>
+
+#define TAIL_LENGTHS 4      // filter_length, 1/2, 1/4 and 1/8 of it
+
+// Fit the echo filter length to the echo tail measured in the converged impulse response
+typedef struct _tail_t {
+    const char *name;       // pipeline name
+    unsigned rate;          // of the echo canceller
+    int lengths[TAIL_LENGTHS];
+    int count;              // lengths in use, the last one only as the overload short filter
+    int index;              // current length
+    int candidate;          // length run alongside the current one until it catches up, -1 if none
+    unsigned trial_frames;  // since the candidate was picked
+    unsigned trial_elapsed; // frames since the last comparison
+    double current_power;   // residual echo of both since the last comparison
+    double candidate_power;
+    int32_t *response;
+    int response_size;
+    unsigned elapsed;       // frames since the last check
+    unsigned since_resize;  // frames since the filter was resized
+    int votes;              // consecutive checks asking for the same resize, shorter < 0 < longer
+    int tail;               // last estimate in taps
+    unsigned resizes;
+    char stat_tail[48];
+    char stat_length[48];
+    char stat_resizes[48];
+} tail_t;
+
+void tail_init(tail_t *t, unsigned rate, int filter_length, const char *name);
+void tail_alloc(tail_t *t, SpeexEchoState *state);
+int tail_lengths(unsigned rate, int filter_length, int *lengths);
+int tail_update(tail_t *t, SpeexEchoState *state, unsigned frames);
+void tail_trial(tail_t *t, double current_power, double candidate_power, unsigned frames);
+
+#endif // _TAIL_H_
@@ -0,0 +1,165 @@
+// trace.c - per-thread timeline of begin/end events
+//
+// Every thread appends to its own buffer, so recording takes no lock. The buffers
+// keep the newest events and are written to a JSON file on exit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_SECONDS 60
+#define TRACE_EVENTS_PER_FRAME 16   // a busy thread records about 8 per frame, twice that with -t 4
+#define TRACE_MIN_EVENTS 65536
+#define TRACE_MAX_EVENTS 262144     // 6 MB per thread, frames shorter than 4 ms get less than a minute
+
+typedef struct
+{
+    double ts;                  // us
+    const char *name;           // a string literal
+    char phase;
+} trace_event_t;
+
+typedef struct
+{
+    const char *name;
+    size_t count;               // events recorded, the buffer keeps the last g_trace_events
+    trace_event_t *events;
+} trace_buffer_t;
+
+int g_trace_enabled = 0;
+
+static const char *g_trace_path;
+static size_t g_trace_events;       // per thread, a power of two
+static trace_buffer_t g_buffers[TRACE_MAX_THREADS];
+static int g_buffer_count = 0;
+static __thread trace_buffer_t *t_buffer;
+
+// events per thread for about a minute of frames
+static size_t trace_events(int frame_ms)
+{
+    if (frame_ms < 1)
+    {
+        return TRACE_MAX_EVENTS;    // rejected later by pipeline_init()
+    }
+
+    size_t needed = (size_t)TRACE_SECONDS * 1000 / frame_ms * TRACE_EVENTS_PER_FRAME;
+    size_t events = TRACE_MIN_EVENTS;
+    while (events < needed && events < TRACE_MAX_EVENTS)
+    {
+        events *= 2;
+    }
+
+    return events;
+}
+
+// arena bytes taken by trace_init(), to add to the reserve
+size_t trace_size(int frame_ms)
+{
+    return TRACE_MAX_THREADS * trace_events(frame_ms) * sizeof(trace_event_t);
+}
+
+void trace_init(const char *path, int frame_ms)
+{
+    g_trace_path = path;
+    g_trace_events = trace_events(frame_ms);
+    for (int i = 0; i < TRACE_MAX_THREADS; i++)
+    {
+        g_buffers[i].events = (trace_event_t *)arena_alloc("trace", g_trace_events * sizeof(trace_event_t));
+    }
+    g_trace_enabled = 1;
+}
+
+static trace_buffer_t *trace_buffer(void)
+{
+    if (t_buffer == NULL)
+    {
+        int index = __atomic_fetch_add(&g_buffer_count, 1, __ATOMIC_ACQ_REL);
+        if (index >= TRACE_MAX_THREADS)
+        {
+            return NULL;
+        }
+        t_buffer = &g_buffers[index];
+    }
+
+    return t_buffer;
+}
+
+// name the calling thread in the timeline
+void trace_thread(const char *name)
+{
+    if (g_trace_enabled)
+    {
+        trace_buffer_t *buffer = trace_buffer();
+        if (buffer)
+        {
+            buffer->name = name;
+        }
+    }
+}
+
+void trace_event(const char *name, char phase)
+{
+    trace_buffer_t *buffer = trace_buffer();
+    if (buffer == NULL)
+    {
+        return;
+    }
+
+    trace_event_t *event = &buffer->events[buffer->count & (g_trace_events - 1)];
+    event->ts = now_us();
+    event->name = name;
+    event->phase = phase;
+    __atomic_store_n(&buffer->count, buffer->count + 1, __ATOMIC_RELEASE);
+}
+
+int trace_write(void)
+{
+    if (!g_trace_enabled)
+    {
+        return 0;
+    }
+
+    FILE *fp = fopen(g_trace_path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "failed to open %s\n", g_trace_path);
+        return -1;
+    }
+
+    int threads = __atomic_load_n(&g_buffer_count, __ATOMIC_ACQUIRE);
+    if (threads > TRACE_MAX_THREADS)
+    {
+        threads = TRACE_MAX_THREADS;
+    }
+
+    int first = 1;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (int tid = 0; tid < threads; tid++)
+    {
+        trace_buffer_t *buffer = &g_buffers[tid];
+        size_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+        size_t start = count > g_trace_events ? count - g_trace_events : 0;
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", tid, buffer->name ? buffer->name : "thread");
+        first = 0;
+
+        for (size_t i = start; i < count; i++)
+        {
+            trace_event_t *event = &buffer->events[i & (g_trace_events - 1)];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.1f,\"pid\":1,\"tid\":%d}",
+                    event->name, event->phase, event->ts, tid);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    printf("Trace written to %s\n", g_trace_path);
+
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+
+// Begin/end events per thread, written as Chrome trace-event JSON (chrome://tracing, Perfetto)
+
+extern int g_trace_enabled;
+
+size_t trace_size(int frame_ms);
+void trace_init(const char *path, int frame_ms);
+void trace_thread(const char *name);
+void trace_event(const char *name, char phase);
+int trace_write(void);
+
+// nothing but a branch when tracing is off
+#define TRACE_BEGIN(name) do { if (g_trace_enabled) trace_event(name, 'B'); } while (0)
+#define TRACE_END(name) do { if (g_trace_enabled) trace_event(name, 'E'); } while (0)
+
+#endif // _TRACE_H_
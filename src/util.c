@@ -1,3 +1,5 @@
+#include <time.h>
+
 // from http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
 unsigned power2(unsigned v)
 {
@@ -10,4 +12,13 @@ unsigned power2(unsigned v)
     v++;
 
     return v;
-}
\ No newline at end of file
+}
+
+// monotonic time in microseconds
+double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
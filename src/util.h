@@ -2,5 +2,6 @@
 #define _UTIL_H_
 
 unsigned power2(unsigned v);
+double now_us(void);
 
-#endif // _UTIL_H_
\ No newline at end of file
+#endif // _UTIL_H_